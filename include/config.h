@@ -16,9 +16,38 @@ class XRPNetConfig {
     std::vector< std::pair<std::string, std::string> > networkList;
 };
 
+class XRPGroupConfig {
+  public:
+    bool enabled {false};
+    std::string address {"239.255.35.40"};
+    int port {3542};
+    int robotId {0};
+    int groupIndex {0};
+    // Only group packets from this address are accepted. Required
+    std::string sender {""};
+};
+
+class XRPImuConfig {
+  public:
+    // 0 leaves the library default in place
+    int odrHz {208};
+    int accelRangeG {0};
+    int gyroRangeDps {0};
+    int filters {0};
+};
+
+class XRPDriveConfig {
+  public:
+    // Matches WPILib's XRPDrivetrain
+    bool rightInverted {true};
+};
+
 class XRPConfiguration {
   public:
     XRPNetConfig networkConfig;
+    XRPGroupConfig groupConfig;
+    XRPImuConfig imuConfig;
+    XRPDriveConfig driveConfig;
 
     std::string toJsonString();
 };
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+// Task IDs for CPU accounting
+#define XRP_CPU_TASK_WEB 0
+#define XRP_CPU_TASK_UDP 1
+#define XRP_CPU_TASK_IMU 2
+#define XRP_CPU_TASK_ROBOT 3
+#define XRP_CPU_TASK_TELEMETRY 4
+#define XRP_CPU_TASK_RANGEFINDER 5
+#define XRP_CPU_TASK_SYSID 6
+#define XRP_CPU_NUM_TASKS 7
+
+// Short window length, and how many of them make up the long window
+#define XRP_CPU_WINDOW_US 1000000
+#define XRP_CPU_LONG_WINDOW_COUNT 10
+
+// Task invocations that can't tell us whether they did anything are
+// counted as idle polling if they finish faster than this
+#define XRP_CPU_POLL_THRESHOLD_US 50
+
+namespace xrp {
+
+/**
+ * Per-core CPU accounting.
+ *
+ * Each core records the time it spends in tasks that actually did work.
+ * Everything else (polling for work that isn't due yet, delay()) is idle.
+ * All calls account against the core they are made from.
+ */
+void cpuloadTaskEnd(uint8_t taskId, unsigned long startUs, bool didWork);
+void cpuloadPeriodic();
+
+// Utilization in percent over the short (1s) and long (10s) windows
+float cpuloadUtilization(int core);
+float cpuloadUtilizationLong(int core);
+
+// Time spent in a task during the last complete short window
+unsigned long cpuloadTaskTimeUs(int core, uint8_t taskId);
+// Longest single run of a task during the last complete short window
+unsigned long cpuloadTaskMaxUs(int core, uint8_t taskId);
+const char* cpuloadTaskName(uint8_t taskId);
+
+// Incremented every time core 0 completes a short window
+unsigned long cpuloadWindowCount();
+
+} // namespace xrp
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hardware watchdog timeout. Core 0 must get through loop() within this time
+#define XRP_HW_WATCHDOG_TIMEOUT_MS 2000
+
+// Number of trace spans kept per core
+#define XRP_CRASHLOG_NUM_SPANS 8
+// Number of stack words captured on a hard fault
+#define XRP_CRASHLOG_STACK_WORDS 16
+
+// Trace span IDs
+#define XRP_SPAN_LOOP_START 0x01
+#define XRP_SPAN_WEB 0x02
+#define XRP_SPAN_UDP_RX 0x03
+#define XRP_SPAN_IMU 0x04
+#define XRP_SPAN_ROBOT 0x05
+#define XRP_SPAN_TELEMETRY 0x06
+#define XRP_SPAN_STATUS 0x07
+#define XRP_SPAN_SYSID 0x08
+#define XRP_SPAN_RANGEFINDER 0x10
+#define XRP_SPAN_CORE1_IDLE 0x11
+
+namespace xrp {
+
+enum ResetReason {
+  RESET_REASON_POWER_ON,
+  RESET_REASON_BROWNOUT,
+  RESET_REASON_RESET_PIN,
+  RESET_REASON_WATCHDOG,
+  RESET_REASON_HARD_FAULT,
+  RESET_REASON_UNKNOWN
+};
+
+// Call first thing in setup(), before anything touches the heap or Serial
+void crashlogInit();
+
+// Write the previous run's record (if any) to flash. Needs LittleFS
+void crashlogPersist();
+
+bool crashlogAvailable();
+ResetReason crashlogResetReason();
+const char* crashlogResetReasonString();
+
+// Record that the current core has entered a span
+void crashlogMark(uint8_t spanId);
+void crashlogUpdateLoopStats(unsigned long avgLoopUs, unsigned long maxLoopUs);
+
+} // namespace xrp
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+// Hosts find robots by sending XRP_DISCOVERY_QUERY to this port, either as a
+// broadcast or to the multicast group below
+#define XRP_DISCOVERY_PORT 3541
+#define XRP_DISCOVERY_MULTICAST_GROUP 239, 255, 35, 41
+#define XRP_DISCOVERY_QUERY "XRP?"
+
+// How often to look for queries. Checking the socket is cheap, but there's
+// no reason to do it every loop
+#define XRP_DISCOVERY_POLL_MS 100
+
+namespace xrp {
+
+void discoveryBegin();
+
+/**
+ * Returns true if a valid query is waiting. The reply goes back to whoever
+ * sent it, via discoveryReply()
+ */
+bool discoveryPoll();
+void discoveryReply(const char* reply, size_t len);
+
+unsigned long discoveryQueryCount();
+
+} // namespace xrp
@@ -15,6 +15,8 @@
 #define encoder_wrap_target 0
 #define encoder_wrap 31
 
+#define encoder_CYCLES_PER_SAMPLE 7
+
 static const uint16_t encoder_program_instructions[] = {
             //     .wrap_target
     0x0010, //  0: jmp    16
@@ -65,11 +67,16 @@ static inline pio_sm_config encoder_program_get_default_config(uint offset) {
     return c;
 }
 
-static inline void encoder_program_init(PIO pio, uint sm, uint offset, uint base_pin) {
+static inline void encoder_program_init(PIO pio, uint sm, uint offset, uint base_pin, float clkdiv) {
     pio_sm_config c = encoder_program_get_default_config(offset);
     sm_config_set_in_pins(&c, base_pin);
     sm_config_set_in_shift(&c, false, false, 32);
     sm_config_set_out_shift(&c, true, false, 32);
+    // Sample-rate limiting: the pins are only sampled once every
+    // (CYCLES_PER_SAMPLE * clkdiv) system clocks. This is not a true glitch
+    // filter. A pulse shorter than the sample interval is usually missed,
+    // but one that happens to land on a sample is still counted.
+    sm_config_set_clkdiv(&c, clkdiv);
     pio_sm_init(pio, sm, offset, &c);
     pio_sm_set_enabled(pio, sm, true);
 }
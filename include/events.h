@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Events waiting to be delivered
+#define XRP_EVENT_QUEUE_SIZE 8
+
+// Resend an event this often until a periodic frame has carried it
+#define XRP_EVENT_RETRANSMIT_MS 10
+
+// Event causes
+#define XRP_EVENT_ENABLED 0x01
+#define XRP_EVENT_DISABLED 0x02
+#define XRP_EVENT_DS_WATCHDOG_TRIP 0x03
+#define XRP_EVENT_ACTUATOR_STALE 0x04     // detail: channel
+#define XRP_EVENT_CORE_STALL 0x05         // detail: core
+#define XRP_EVENT_OVERLOAD 0x06           // detail: new overload level
+#define XRP_EVENT_GYRO_CAL_FAILED 0x07
+#define XRP_EVENT_IMPACT 0x08             // detail: axes (bit 2 = X, bit 1 = Y, bit 0 = Z)
+#define XRP_EVENT_TILT 0x09
+#define XRP_EVENT_FREEFALL 0x0A
+#define XRP_EVENT_SAFETY_STOP 0x0B        // detail: event cause that stopped the motors
+#define XRP_EVENT_PROXIMITY_STOP 0x0C     // detail: distance in cm (capped at 255)
+
+namespace xrp {
+
+struct XRPEvent {
+  uint16_t id;
+  uint8_t cause;
+  uint8_t detail;
+  uint32_t timeMs;
+};
+
+/**
+ * Queue an event for the host. It goes out in its own datagram right away,
+ * is resent every XRP_EVENT_RETRANSMIT_MS, and is dropped from the queue
+ * once a periodic telemetry frame has carried it. Core 0 only.
+ */
+void eventsPost(uint8_t cause, uint8_t detail = 0);
+
+// True if there are events that haven't been sent recently
+bool eventsDue();
+
+// Copy out the undelivered events, oldest first. Returns how many
+int eventsPending(XRPEvent* out, int maxEvents);
+
+// Note that the undelivered events were just sent out of cycle
+void eventsMarkSent();
+
+// Note that a periodic frame carried the undelivered events
+void eventsMarkDelivered();
+
+unsigned long eventsDroppedCount();
+
+} // namespace xrp
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Max datagrams to pull off the group socket per loop
+#define XRP_GROUP_MAX_PACKETS_PER_LOOP 2
+
+// Scheduled commands waiting for their apply time
+#define XRP_GROUP_QUEUE_SIZE 4
+#define XRP_GROUP_MAX_COMMAND_BYTES 64
+
+// Commands scheduled further out than this are assumed to be garbage
+#define XRP_GROUP_MAX_SCHEDULE_MS 5000
+
+// Group command targets
+#define XRP_GROUP_TARGET_ALL 0
+#define XRP_GROUP_TARGET_ROBOT 1
+#define XRP_GROUP_TARGET_GROUP 2
+
+namespace xrp {
+
+/**
+ * Join the multicast group and start accepting group commands from `sender`.
+ *
+ * Group packets use the normal [seq][ctrl][tagged data] layout, but only
+ * XRP_TAG_GROUP_TIME and XRP_TAG_GROUP_COMMAND are accepted at the top level.
+ * Each group command carries its own tagged data, which is applied only by
+ * the robots it is addressed to, either right away or at a scheduled time
+ * on the sender's clock. Only actuator tags are applied from a group command.
+ *
+ * Packets from any other address are dropped, and the sender is rate limited
+ * like a unicast host. Without a valid sender, the group is never joined.
+ */
+void groupBegin(const char* address, int port, int robotId, int groupIndex, const char* sender);
+bool groupEnabled();
+
+// Read group packets. These are dropped while a unicast host is in control,
+// and anything already scheduled is thrown away when it takes over
+void groupPoll(bool unicastActive);
+
+// Apply scheduled commands that are due (not while a unicast host is in control)
+void groupPeriodic();
+
+// Forget the sender's sequence number, so a restarted sender is heard.
+// Call on DS watchdog timeout, like wpilibudp::resetState()
+void groupResetState();
+
+bool groupClockSynced();
+// Sender clock minus our clock
+int32_t groupClockOffsetMs();
+
+unsigned long groupPacketCount();
+unsigned long groupCommandsApplied();
+unsigned long groupCommandsLate();
+
+} // namespace xrp
@@ -5,18 +5,98 @@
 
 #define IMU_I2C_ADDR 0x6B
 #define IMU_UPDATE_RATE_HZ 20
+#define IMU_MADGWICK_LOOP_FREQ_HZ 25
+
+#define IMU_CAL_MOTION_THRESHOLD_DPS 3.0
+#define IMU_CAL_MOTION_THRESHOLD_G 0.1
+#define IMU_CAL_STATUS_HOLD_MS 1000
+
+// Online gyro bias tracking. Stationary windows are averaged into 1C
+// temperature bins, and a bias vs temperature slope is fitted across them
+#define IMU_BIAS_WINDOW_MS 2000
+#define IMU_BIAS_STATIONARY_SPREAD_DPS 0.5
+#define IMU_BIAS_MAX_STEP_DPS 2.0
+#define IMU_BIAS_MIN_TEMP_C -10
+#define IMU_BIAS_MAX_TEMP_C 69
+#define IMU_BIAS_MIN_BINS 3
+#define IMU_BIAS_MIN_SPAN_C 4
+#define IMU_BIAS_SAVE_INTERVAL_MS 60000
+
+// AHRS convergence. While not converged, each filter update is followed by
+// extra accel-only correction steps, which multiplies the filter gain. The
+// extra steps are budgeted per second, so a faster filter does fewer per update
+#define IMU_AHRS_FAST_SUBSTEPS 10
+#define IMU_AHRS_FAST_STEPS_PER_SEC 250
+#define IMU_AHRS_SEED_ITERATIONS 500
+#define IMU_AHRS_CONVERGED_DEG 2.0
+#define IMU_AHRS_DIVERGED_DEG 10.0
+#define IMU_AHRS_SETTLE_SAMPLES 5
+// Only trust the accelerometer as a gravity reference within this much of 1G
+#define IMU_AHRS_STATIC_TOLERANCE_G 0.1
+
+// Fastest the AHRS filter runs when it follows the data rate. Each update
+// is an I2C read plus a soft-float filter step in the main loop. Data rates
+// up to IMU_DEFAULT_ODR_HZ keep IMU_MADGWICK_LOOP_FREQ_HZ
+#define IMU_MAX_FILTER_RATE_HZ 100
+
+// Default output data rate (both sensors)
+#define IMU_DEFAULT_ODR_HZ 208
+
+// On-chip filter bits (imuConfigureSensor)
+#define IMU_FILTER_ACCEL_LPF2 0x01
+#define IMU_FILTER_GYRO_LPF1 0x02
+// Bits 4-6 select the gyro LPF1 bandwidth (FTYPE, 0 = widest)
+#define IMU_FILTER_GYRO_LPF1_BW_SHIFT 4
+
+// Motion event defaults (XRP_TAG_MOTION_CONFIG overrides these)
+#define IMU_MOTION_IMPACT_DEFAULT_MG 1500
+#define IMU_MOTION_TILT_DEFAULT_DEG 60
+#define IMU_MOTION_FREEFALL_DEFAULT_MS 80
+// Tilt has to persist this many filter updates before it counts
+#define IMU_MOTION_TILT_SAMPLES 5
+#define IMU_MOTION_TILT_HYSTERESIS_DEG 10
+
+// Motion event bitmask
+#define IMU_MOTION_IMPACT 0x01
+#define IMU_MOTION_TILT 0x02
+#define IMU_MOTION_FREEFALL 0x04
+
+// IMU axis bitmask
+#define IMU_AXIS_ROLL 0x01
+#define IMU_AXIS_PITCH 0x02
+#define IMU_AXIS_YAW 0x04
 
 namespace xrp {
 
+enum IMUCalibrationState { IMU_CAL_IDLE, IMU_CAL_RUNNING, IMU_CAL_COMPLETE, IMU_CAL_FAILED };
+
 bool imuIsReady();
 
 void imuSetEnabled(bool enabled);
 bool imuIsEnabled();
 
 void imuInit(uint8_t addr, TwoWire *theWire);
+
+/**
+ * Set the output data rate, full-scale ranges and on-chip filters.
+ * A value of 0 leaves that setting alone. Rates and ranges are rounded
+ * up to the nearest one the chip supports. Anything that depends on them
+ * (filter rate, calibration pacing, motion thresholds) follows along
+ */
+void imuConfigureSensor(uint16_t odrHz, uint8_t accelRangeG, uint16_t gyroRangeDps, uint8_t filters);
+int imuGetOdrHz();
+int imuGetAccelRangeG();
+int imuGetGyroRangeDps();
 void imuCalibrate(unsigned long calibrationTime);
 
-void imuPeriodic();
+// Non-blocking recalibration, run from imuPeriodic()
+bool imuStartCalibration(unsigned long calibrationTimeMs);
+IMUCalibrationState imuGetCalibrationState();
+uint8_t imuGetCalibrationProgress();
+
+bool imuPeriodic();
+void imuSetFilterRate(int rateHz);
+int imuGetFilterRate();
 bool imuDataReady();
 
 float imuGetAccelX();
@@ -27,6 +107,28 @@ float imuGetGyroRateX();
 float imuGetGyroRateY();
 float imuGetGyroRateZ();
 
+// Chip temperature (C), read with every filter update
+float imuGetTemperatureC();
+
+/**
+ * Allow or stop online bias learning. Only allow it when nothing is
+ * driving the robot, otherwise a slow steady turn would be learned as bias
+ */
+void imuSetBiasLearning(bool allowed);
+
+// True once there's enough data to correct gyro bias for temperature
+bool imuBiasModelValid();
+
+/**
+ * Save the learned gyro bias model if it has changed, at most once every
+ * IMU_BIAS_SAVE_INTERVAL_MS. Writes to flash, so only call this when a
+ * session ends or there is no host
+ */
+void imuBiasModelSave();
+
+// True once the AHRS roll/pitch agree with gravity
+bool imuAhrsConverged();
+
 float imuGetRoll();
 float imuGetPitch();
 float imuGetYaw();
@@ -35,6 +137,25 @@ void imuResetRoll();
 void imuResetPitch();
 void imuResetYaw();
 
+void imuResetAxes(uint8_t axisMask);
+
+/**
+ * Configure motion event detection. Impact (wake-up) and free-fall are
+ * detected by the LSM6DSOX at its full data rate and latched until we read
+ * them. Tilt-over is checked in firmware on each filter update.
+ * A threshold of 0 turns that detector off.
+ */
+void imuConfigureMotionEvents(uint16_t impactMg, uint8_t tiltDeg, uint16_t freeFallMs);
+
+// Motion events (IMU_MOTION_*) detected since the last call
+uint8_t imuTakeMotionEvents();
+// Axes that crossed the impact threshold (bit 2 = X, bit 1 = Y, bit 0 = Z)
+uint8_t imuLastImpactAxes();
+
+// Motion events (IMU_MOTION_*) that should stop the motors
+void imuSetMotionCutoff(uint8_t eventMask);
+uint8_t imuMotionCutoffMask();
+
 void gyroReset();
 
 } // namespace xrp
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+// Core 1 only runs the rangefinder and beats inside its wait loops, so it
+// should never go quiet for long
+#define XRP_CORE1_STALL_MS 5
+// Core 1 gets restarted if it stays stalled this long
+#define XRP_CORE1_RESTART_MS 100
+
+// Core 0 can legitimately block for a while in the Wi-Fi driver or while
+// serving a web page, so give it more room before stopping the motors.
+// Serving the larger web resources over a busy link can take
+// tens of ms; check xrp_cpu_task_max_us{task="web"} in /metrics
+// before tightening this
+#define XRP_CORE0_STALL_MS 100
+
+namespace xrp {
+
+// Mark the calling core as alive
+void livenessBeat();
+
+// Run from core 0: watch core 1, restart it if it is stuck
+void livenessCheckCore1();
+
+// Run from core 1: watch core 0, stop the motors if it is stuck
+void livenessCheckCore0();
+
+/**
+ * Suspend both checks around a flash write. Writing flash stops core 1 and
+ * can hold up core 0 for tens of ms, which isn't a stall. Heartbeat ages
+ * are measured from the resume. Core 0 only. Calls can nest.
+ */
+void livenessPause();
+void livenessResume();
+
+bool livenessCoreStalled(int core);
+unsigned long livenessStallCount(int core);
+
+} // namespace xrp
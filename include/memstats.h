@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+// Pattern written into unused stack space at boot
+#define XRP_STACK_PAINT_PATTERN 0xDEADBEEF
+// Space left untouched below the stack pointer while painting
+#define XRP_STACK_PAINT_MARGIN 256
+
+namespace xrp {
+
+// Paint the unused part of the calling core's stack. Call this as early as
+// possible in setup() (core 0) and setup1() (core 1)
+void memstatsPaintStack();
+
+/**
+ * Stack size and the most stack ever used, in bytes.
+ *
+ * Returns -1 if the core's stack isn't one we know about (or wasn't painted)
+ */
+int memstatsStackSize(int core);
+int memstatsStackHighWater(int core);
+
+// Heap usage, in bytes
+size_t memstatsHeapTotal();
+size_t memstatsHeapUsed();
+size_t memstatsHeapPeak();
+// Free space at the top of the heap (a lower bound on the largest allocation)
+size_t memstatsHeapTopFree();
+
+} // namespace xrp
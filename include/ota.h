@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A newly installed image has to keep running this long before it's
+// considered good
+#define XRP_OTA_HEALTH_CHECK_MS 30000
+
+// Give the HTTP response time to go out before rebooting into the new image
+#define XRP_OTA_REBOOT_DELAY_MS 500
+
+namespace xrp {
+
+enum OtaState {
+  OTA_STATE_NONE,       // No update has been installed
+  OTA_STATE_PENDING,    // Image staged, will be installed on the next boot
+  OTA_STATE_TRIAL,      // Running a new image that hasn't passed its health check
+  OTA_STATE_CONFIRMED,  // New image passed its health check
+  OTA_STATE_FAILED      // New image reset before passing its health check
+};
+
+// Load the update state and advance it for this boot. Needs LittleFS
+void otaInit();
+
+// Confirms a trial image once it has been up long enough, and reboots
+// into a freshly staged image
+void otaPeriodic();
+
+/**
+ * Streaming upload. The image is written to the staging area chunk by chunk
+ * and a running CRC32 is kept. otaBegin() fails up front if imageSize won't
+ * fit in the filesystem. otaEnd() only stages the image for install if every
+ * byte arrived and the CRC matches.
+ */
+bool otaBegin(uint32_t expectedCrc, size_t imageSize);
+bool otaWrite(const uint8_t* buf, size_t len);
+bool otaEnd();
+void otaAbort();
+// Refuse an upload before it starts, and remember why for otaLastError()
+void otaReject(const char* error);
+
+bool otaInProgress();
+const char* otaLastError();
+
+OtaState otaState();
+const char* otaStateString();
+
+} // namespace xrp
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Shedding levels. Each level also sheds everything below it
+#define XRP_OVERLOAD_LEVEL_NONE 0
+#define XRP_OVERLOAD_LEVEL_WEB 1
+#define XRP_OVERLOAD_LEVEL_TELEMETRY 2
+#define XRP_OVERLOAD_LEVEL_IMU 3
+#define XRP_OVERLOAD_NUM_LEVELS 4
+
+// Loop time percentile that drives the controller, evaluated once per window
+#define XRP_OVERLOAD_WINDOW_MS 1000
+#define XRP_OVERLOAD_PERCENTILE 99
+
+// Go up a level when the percentile loop time is above the high mark, and
+// back down once it has stayed under the low mark for a few windows
+#define XRP_OVERLOAD_HIGH_US 10000
+#define XRP_OVERLOAD_LOW_US 5000
+#define XRP_OVERLOAD_RECOVER_WINDOWS 3
+
+// While shedding web serving, still service it this often
+#define XRP_OVERLOAD_WEB_INTERVAL_MS 250
+
+namespace xrp {
+
+void overloadRecordLoopTime(unsigned long loopTimeUs);
+void overloadPeriodic();
+
+uint8_t overloadLevel();
+bool overloadShedding(uint8_t level);
+const char* overloadLevelName(uint8_t level);
+
+// Percentile loop time from the last complete window
+unsigned long overloadLoopTimePercentileUs();
+
+// Time since the current level was entered
+unsigned long overloadLevelDurationMs();
+
+// Total time spent at a given level
+unsigned long overloadTimeAtLevelMs(uint8_t level);
+
+} // namespace xrp
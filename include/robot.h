@@ -33,19 +33,62 @@
 #define ENC_SM_IDX_MOTOR_3 2
 #define ENC_SM_IDX_MOTOR_4 3
 
+// Max number of WPILib encoder devices the host can map onto the native encoders
+#define XRP_MAX_ENCODER_DEVICES 8
+
+// Encoder inputs are sampled at this interval (ns). This only limits the
+// sample rate: pulses shorter than this are usually missed, but can still be
+// counted if one lands on a sample
+#define XRP_ENCODER_SAMPLE_INTERVAL_NS 1000
+
+// Encoders must be still this long for the robot to count as at rest
+#define XRP_AT_REST_MS 500
+
 #define XRP_BUILTIN_LED LED_BUILTIN
 #define XRP_BUILTIN_BUTTON 22
 
+// Time between rangefinder triggers. A full 4m echo takes ~23ms, which
+// leaves time for stray echoes to die down
+#define XRP_RANGEFINDER_PERIOD_MS 30
+// Median filter over this many measurements
+#define XRP_RANGEFINDER_FILTER_SIZE 5
+// Need at least this many good measurements in the filter to be valid
+#define XRP_RANGEFINDER_MIN_VALID 3
+
 #define WPILIB_CH_PWM_MOTOR_L 0
 #define WPILIB_CH_PWM_MOTOR_R 1
 #define WPILIB_CH_PWM_MOTOR_3 2
 #define WPILIB_CH_PWM_MOTOR_4 3
 #define WPILIB_CH_PWM_SERVO_1 4
 #define WPILIB_CH_PWM_SERVO_2 5
+#define XRP_NUM_PWM_CHANNELS 6
+
+// What to do with an actuator that hasn't been commanded within its timeout.
+// For servos, zero is the center position
+#define XRP_ACTUATOR_FALLBACK_ZERO 0
+#define XRP_ACTUATOR_FALLBACK_HOLD 1
+#define XRP_ACTUATOR_FALLBACK_RAMP 2
+
+// How often a ramping actuator gets a new value
+#define XRP_ACTUATOR_RAMP_STEP_MS 10
+
+// Why an actuator's output differs from what the host commanded
+#define XRP_ACTUATOR_REASON_NONE 0
+#define XRP_ACTUATOR_REASON_CLAMPED 1
+#define XRP_ACTUATOR_REASON_DISABLED 2
+#define XRP_ACTUATOR_REASON_DS_WATCHDOG 3
+#define XRP_ACTUATOR_REASON_SAFETY_STOP 4
+#define XRP_ACTUATOR_REASON_PROXIMITY_STOP 5
+#define XRP_ACTUATOR_REASON_STALE 6
 
 #define XRP_SERVO_MIN_PULSE_US 500
 #define XRP_SERVO_MAX_PULSE_US 2500
 
+// Telemetry is sent every XRP_TELEMETRY_PERIOD_MS, unless it is locked
+// onto the host's command packets (see telemetrysync.h). It is stretched to
+// the IMU sample period if the IMU data rate is set lower than that
+#define XRP_TELEMETRY_PERIOD_MS 50
+
 #define XRP_DATA_ENCODER 0x01
 #define XRP_DATA_DIO 0x02
 #define XRP_DATA_AIO 0x04
@@ -59,32 +102,98 @@ uint8_t robotPeriodic();
 
 // Robot control
 void robotSetEnabled(bool enabled);
+bool robotEnabled();
+void robotStopMotors();
+
+/**
+ * True if nothing should be moving the robot: it is disabled or every
+ * motor output is zero, and no encoder has moved for XRP_AT_REST_MS
+ */
+bool robotAtRest();
+
+/**
+ * Force the motor enable pins low, from either core. Only touches the
+ * pin mux and the atomic SIO registers, not the PWM slices or any motor
+ * state. Core 0 undoes it with robotRestoreMotorOutputs()
+ */
+void robotCutMotorOutputs();
+void robotRestoreMotorOutputs();
+
+/**
+ * Stop the motors and keep them stopped until the host disables and
+ * re-enables the robot. Servos are left alone
+ */
+void robotSafetyStop(uint8_t cause);
+bool robotSafetyStopped();
 
 // Encoder Related
 void configureEncoder(int deviceId, int chA, int chB);
 int readEncoder(int deviceId);
-int readEncoderRaw(int rawDeviceId);
+int64_t readEncoderRaw(int rawDeviceId);
+// Read the state machine right now, rather than the last periodic value
+int64_t sampleEncoderRaw(int rawDeviceId);
 void resetEncoder(int deviceId);
+void setEncoderReversed(int deviceId, bool reversed);
+bool encodersConfigured();
 std::vector<std::pair<int,int> > getActiveEncoderValues();
 
 // PWM Related
 void setPwmValue(int wpilibChannel, double value);
+// Set several channels at once. Bit n of mask selects channel n
+void setPwmValues(const double values[XRP_NUM_PWM_CHANNELS], uint8_t mask);
+
+// Per-channel command timeouts. A timeout of 0 disables the check
+void setActuatorTimeout(int wpilibChannel, unsigned long timeoutMs, uint8_t fallback, unsigned long rampMs);
+bool actuatorStale(int wpilibChannel);
+
+/**
+ * What a channel is actually putting out, after quantization (8-bit motor
+ * PWM, whole servo degrees) and any override. Same units as the host
+ * commands: motors -1 to 1, servos 0 to 1
+ */
+float actuatorOutput(int wpilibChannel);
+// XRP_ACTUATOR_REASON_* for the last time the channel was written or blocked
+uint8_t actuatorOverrideReason(int wpilibChannel);
+
+/**
+ * Hand a channel over to the firmware (e.g. a SysId test). Host commands
+ * and timeouts for it are ignored until it is released. Enable, DS
+ * watchdog and safety stop still apply
+ */
+void robotClaimChannel(int wpilibChannel, bool claimed);
+void robotSetClaimedOutput(int wpilibChannel, double value);
 
 // DIO Related
 bool isUserButtonPressed();
 void setDigitalOutput(int channel, bool value);
 
 // Line/Reflectance Sensing Related
+bool reflectanceProbe();
 void reflectanceInit();
 bool reflectanceInitialized();
 float getReflectanceLeft5V();
 float getReflectanceRight5V();
 
 // Rangefinder
+bool rangefinderProbe();
 void rangefinderInit();
 bool rangefinderInitialized();
 float getRangefinderDistance5V();
+float getRangefinderDistanceMetres();
+bool rangefinderValid();
+float rangefinderSampleRateHz();
 void rangefinderPollForData();
 void rangefinderPeriodic();
 
+/**
+ * Block forward drive while a valid rangefinder reading is closer than
+ * distanceMm. Turning and reversing still work. 0 turns it off
+ */
+void setProximityStop(uint16_t distanceMm);
+bool proximityStopActive();
+
+// Which way round the drive motors are wired, for telling forward from
+// turning. Defaults to the right motor inverted, like XRPDrivetrain
+void setDriveRightInverted(bool inverted);
+
 } // namespace xrp
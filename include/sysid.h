@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+// The test runs at this rate, whatever it records
+#define XRP_SYSID_CONTROL_PERIOD_US 1000
+
+// Sample buffer (16 bytes each, allocated on the first test). Longer tests
+// record every Nth control step to fit
+#define XRP_SYSID_MAX_SAMPLES 2000
+#define XRP_SYSID_MAX_DURATION_MS 20000
+
+// Velocity is the position change over this many control steps
+#define XRP_SYSID_VELOCITY_WINDOW 10
+
+// Streaming the results back
+#define XRP_SYSID_SAMPLES_PER_TAG 16
+#define XRP_SYSID_TAGS_PER_PACKET 4
+#define XRP_SYSID_STREAM_INTERVAL_US 2000
+
+// Test modes (XRP_TAG_SYSID_START)
+#define XRP_SYSID_MODE_QUASISTATIC 1
+#define XRP_SYSID_MODE_DYNAMIC 2
+
+// Control actions (XRP_TAG_SYSID_CONTROL)
+#define XRP_SYSID_ACTION_ABORT 0
+#define XRP_SYSID_ACTION_SEND 1
+
+namespace xrp {
+
+enum SysIdState { SYSID_IDLE, SYSID_RUNNING, SYSID_DONE, SYSID_ABORTED };
+
+struct SysIdSample {
+  uint32_t timeUs;   // Since the start of the test
+  float output;      // Effective motor output, -1 to 1
+  int32_t position;  // Raw encoder counts
+  float velocity;    // Raw encoder counts per second
+};
+
+/**
+ * On-device system identification.
+ *
+ * Drives one motor through a quasistatic ramp (value = output per second)
+ * or a dynamic step (value = output) for durationMs, at 1kHz from the main
+ * loop, reading the encoder state machine directly each step. A step that
+ * comes due while the loop is busy elsewhere is skipped and counted as an
+ * overrun, which is reported to the host. Results are kept in RAM and
+ * streamed to the host once the test is over. The test
+ * stops if the robot is disabled, the DS watchdog times out or a safety
+ * stop kicks in. Core 0 only.
+ */
+bool sysidStart(int motorChannel, uint8_t mode, float value, uint16_t durationMs);
+void sysidAbort();
+void sysidPeriodic();
+
+SysIdState sysidState();
+bool sysidRunning();
+int sysidSampleCount();
+uint32_t sysidSamplePeriodUs();
+// Control steps missed because the loop was late
+unsigned long sysidOverrunCount();
+
+// (Re)send the results, starting at sample fromIndex
+void sysidRequestData(uint16_t fromIndex);
+
+// True if a packet of results should go out now
+bool sysidStreamDue();
+
+// Copy out the next chunk of results to send. Returns how many
+int sysidNextChunk(SysIdSample* out, int maxSamples, uint16_t* firstIndex);
+
+} // namespace xrp
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// Send telemetry this long before the host's next command is expected
+#define XRP_TELEMETRY_SYNC_DEFAULT_LEAD_US 2000
+
+// Command intervals outside this range don't look like a periodic host loop
+#define XRP_TELEMETRY_SYNC_MIN_PERIOD_US 5000
+#define XRP_TELEMETRY_SYNC_MAX_PERIOD_US 200000
+
+// Lock after this many intervals in a row within 10% of the estimate
+#define XRP_TELEMETRY_SYNC_LOCK_COUNT 10
+
+// Lose lock after this many expected commands go missing
+#define XRP_TELEMETRY_SYNC_MISSED_PERIODS 3
+
+// Never send telemetry faster than this, however fast the host runs
+#define XRP_TELEMETRY_SYNC_MIN_SEND_PERIOD_US 10000
+
+namespace xrp {
+
+/**
+ * Phase-locked telemetry.
+ *
+ * Tracks the period and phase of the host's command packets, and schedules
+ * each telemetry frame to go out just ahead of the next command. The host
+ * sends commands from the same loop that reads telemetry, so a frame sent
+ * then is as fresh as it can be when the host looks at it. Until it locks
+ * (and whenever it loses lock) telemetry falls back to the fixed period.
+ * Core 0 only.
+ */
+
+// Note a command packet from the host
+void telemetrySyncOnCommand(unsigned long nowUs);
+
+// Lead of 0 turns syncing off
+void telemetrySyncSetLead(uint16_t leadUs);
+uint16_t telemetrySyncLead();
+
+bool telemetrySyncLocked();
+
+// True if a synced telemetry frame should go out now
+bool telemetrySyncDue(unsigned long nowUs);
+void telemetrySyncMarkSent(unsigned long nowUs);
+
+// Estimated host command period
+unsigned long telemetrySyncPeriodUs();
+
+// How far ahead of the ideal time the last frame reached the host's
+// loop (positive = early, so that much staler than it could have been)
+int32_t telemetrySyncPhaseErrorUs();
+
+} // namespace xrp
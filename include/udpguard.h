@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Number of sources we keep token buckets for
+#define XRP_UDP_GUARD_NUM_SOURCES 4
+
+// Per-source token bucket. Hosts normally send every 20ms
+#define XRP_UDP_RATE_LIMIT_PPS 200
+#define XRP_UDP_RATE_LIMIT_BURST 20
+
+// Max datagrams to pull off the socket per loop
+#define XRP_UDP_MAX_PACKETS_PER_LOOP 4
+
+namespace xrp {
+
+enum UdpAdmitResult { UDP_ADMIT, UDP_REJECT_NOT_OWNER, UDP_REJECT_RATE_LIMITED };
+
+/**
+ * Decide whether to process a datagram, before touching its payload.
+ *
+ * While a session is active, only the owner (the host that the session
+ * belongs to) gets through. Every source is also rate limited.
+ */
+UdpAdmitResult udpGuardCheck(uint32_t addr, uint16_t port, bool sessionActive, uint32_t ownerAddr, uint16_t ownerPort);
+
+unsigned long udpGuardAcceptedCount();
+unsigned long udpGuardNotOwnerCount();
+unsigned long udpGuardRateLimitedCount();
+
+} // namespace xrp
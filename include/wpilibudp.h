@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "sysid.h"
+
 #define XRP_TAG_MOTOR 0x12
 #define XRP_TAG_SERVO 0x13
 #define XRP_TAG_DIO 0x14
@@ -8,16 +12,90 @@
 #define XRP_TAG_ACCEL 0x17
 #define XRP_TAG_ENCODER 0x18
 
+// Firmware extensions (host -> XRP)
+#define XRP_TAG_ENCODER_CONFIG 0x20
+#define XRP_TAG_ENCODER_RESET 0x21
+#define XRP_TAG_ENCODER_DIRECTION 0x22
+#define XRP_TAG_GYRO_RESET 0x23
+#define XRP_TAG_GYRO_CALIBRATE 0x24
+#define XRP_TAG_HELLO 0x25
+#define XRP_TAG_TELEMETRY_CONFIG 0x26
+#define XRP_TAG_ACTUATOR_TIMEOUT 0x27
+
+// Multicast group extensions (host -> XRP, group socket only)
+#define XRP_TAG_GROUP_TIME 0x28
+#define XRP_TAG_GROUP_COMMAND 0x29
+
+#define XRP_TAG_ACTUATORS 0x2A
+#define XRP_TAG_MOTION_CONFIG 0x2B
+#define XRP_TAG_PROXIMITY_STOP 0x2C
+#define XRP_TAG_IMU_CONFIG 0x2D
+#define XRP_TAG_TELEMETRY_SYNC_CONFIG 0x2E
+#define XRP_TAG_SYSID_START 0x2F
+#define XRP_TAG_SYSID_CONTROL 0x30
+
+// Firmware extensions (XRP -> host)
+#define XRP_TAG_GYRO_CAL_STATUS 0x40
+#define XRP_TAG_CAPABILITIES 0x41
+#define XRP_TAG_CPU_LOAD 0x42
+#define XRP_TAG_EVENT 0x43
+#define XRP_TAG_DISTANCE 0x44
+#define XRP_TAG_IMU_STATUS 0x45
+#define XRP_TAG_TELEMETRY_SYNC 0x46
+#define XRP_TAG_ACTUATOR_STATE 0x47
+#define XRP_TAG_SYSID_STATUS 0x48
+#define XRP_TAG_SYSID_DATA 0x49
+
+// Version of the firmware protocol extensions. Bump this when adding tags
+#define XRP_PROTOCOL_EXT_VERSION 1
+
+// Capability bits
+#define XRP_CAP_ENCODING_FLOAT32 0x01
+
+#define XRP_CAP_SENSOR_IMU 0x01
+#define XRP_CAP_SENSOR_REFLECTANCE 0x02
+#define XRP_CAP_SENSOR_RANGEFINDER 0x04
+
+// IMU status flags (XRP_TAG_IMU_STATUS)
+#define XRP_IMU_STATUS_AHRS_CONVERGED 0x01
+#define XRP_IMU_STATUS_BIAS_MODEL 0x02
+
+// Optional telemetry bits (XRP_TAG_TELEMETRY_CONFIG)
+#define XRP_TELEMETRY_OPT_CPU_LOAD 0x0001
+#define XRP_TELEMETRY_OPT_ACTUATOR_STATE 0x0002
+
+// Actuator state values are sent in these units (1.0 = 10000)
+#define XRP_ACTUATOR_STATE_SCALE 10000
+
 namespace wpilibudp {
 
 bool dsWatchdogActive();
 
 bool processPacket(char* buffer, int size);
+// Apply a packet's control byte and feed the DS watchdog
+void applyControl(uint8_t ctrl);
+// Process a run of [size][tag][payload] entries in [start, end)
+void processTags(char* buffer, int start, int end);
 void resetState();
 
+bool capabilitiesRequested();
+void clearCapabilitiesRequest();
+uint8_t negotiatedProtocolVersion();
+uint16_t telemetryOptions();
+
 int writeEncoderData(int deviceId, int count, char* buffer, int offset = 0);
 int writeDIOData(int deviceId, bool value, char* buffer, int offset = 0);
 int writeGyroData(float rates[3], float angles[3], char* buffer, int offset = 0);
 int writeAccelData(float accels[3], char* buffer, int offset = 0);
 int writeAnalogData(int deviceId, float voltage, char* buffer, int offset = 0);
+int writeGyroCalStatusData(uint8_t state, uint8_t progress, char* buffer, int offset = 0);
+int writeCpuLoadData(uint8_t core0Pct, uint8_t core0LongPct, uint8_t core1Pct, uint8_t core1LongPct, char* buffer, int offset = 0);
+int writeEventData(uint16_t eventId, uint8_t cause, uint8_t detail, uint32_t timeMs, char* buffer, int offset = 0);
+int writeDistanceData(float distMetres, bool valid, uint8_t rateHz, char* buffer, int offset = 0);
+int writeSysIdStatusData(uint8_t state, uint16_t sampleCount, uint32_t samplePeriodUs, uint32_t overruns, char* buffer, int offset = 0);
+int writeSysIdData(uint16_t firstIndex, const xrp::SysIdSample* samples, int count, char* buffer, int offset = 0);
+int writeActuatorStateData(const float outputs[], const uint8_t reasons[], int numChannels, char* buffer, int offset = 0);
+int writeTelemetrySyncData(bool locked, uint32_t periodUs, int32_t phaseErrorUs, char* buffer, int offset = 0);
+int writeImuStatusData(uint8_t flags, float temperatureC, char* buffer, int offset = 0);
+int writeCapabilitiesData(uint8_t fwVersion[3], uint8_t maxRateHz, uint8_t sensors, char* buffer, int offset = 0);
 } // namespace wpilibudp
\ No newline at end of file
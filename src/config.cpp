@@ -63,7 +63,7 @@ XRPConfiguration generateDefaultConfig(std::string defaultAPName) {
 }
 
 std::string XRPConfiguration::toJsonString() {
-  StaticJsonDocument<512> config;
+  StaticJsonDocument<1024> config;
 
   config["configVersion"] = XRP_CONFIG_VERSION;
 
@@ -83,6 +83,26 @@ std::string XRPConfiguration::toJsonString() {
     networkObj["password"] = netInfo.second;
   }
 
+  // Multicast group control
+  JsonObject group = config.createNestedObject("group");
+  group["enabled"] = groupConfig.enabled;
+  group["address"] = groupConfig.address;
+  group["port"] = groupConfig.port;
+  group["robotId"] = groupConfig.robotId;
+  group["groupIndex"] = groupConfig.groupIndex;
+  group["sender"] = groupConfig.sender;
+
+  // IMU
+  JsonObject imu = config.createNestedObject("imu");
+  imu["odrHz"] = imuConfig.odrHz;
+  imu["accelRangeG"] = imuConfig.accelRangeG;
+  imu["gyroRangeDps"] = imuConfig.gyroRangeDps;
+  imu["filters"] = imuConfig.filters;
+
+  // Drivetrain
+  JsonObject drive = config.createNestedObject("drive");
+  drive["rightInverted"] = driveConfig.rightInverted;
+
   std::string ret;
   serializeJsonPretty(config, ret);
   return ret;
@@ -107,7 +127,7 @@ XRPConfiguration loadConfiguration(std::string defaultAPName) {
   }
 
   // Load and verify
-  StaticJsonDocument<512> configJson;
+  StaticJsonDocument<1024> configJson;
   auto jsonErr = deserializeJson(configJson, f);
   f.close();
 
@@ -201,6 +221,31 @@ XRPConfiguration loadConfiguration(std::string defaultAPName) {
     shouldWrite = true;
   }
 
+  // Group section is optional. Anything missing keeps its default
+  if (configJson.containsKey("group")) {
+    auto groupInfo = configJson["group"];
+    config.groupConfig.enabled = groupInfo["enabled"] | config.groupConfig.enabled;
+    config.groupConfig.address = groupInfo["address"] | config.groupConfig.address;
+    config.groupConfig.port = groupInfo["port"] | config.groupConfig.port;
+    config.groupConfig.robotId = groupInfo["robotId"] | config.groupConfig.robotId;
+    config.groupConfig.groupIndex = groupInfo["groupIndex"] | config.groupConfig.groupIndex;
+    config.groupConfig.sender = groupInfo["sender"] | config.groupConfig.sender;
+  }
+
+  // IMU section is optional too
+  if (configJson.containsKey("imu")) {
+    auto imuInfo = configJson["imu"];
+    config.imuConfig.odrHz = imuInfo["odrHz"] | config.imuConfig.odrHz;
+    config.imuConfig.accelRangeG = imuInfo["accelRangeG"] | config.imuConfig.accelRangeG;
+    config.imuConfig.gyroRangeDps = imuInfo["gyroRangeDps"] | config.imuConfig.gyroRangeDps;
+    config.imuConfig.filters = imuInfo["filters"] | config.imuConfig.filters;
+  }
+
+  if (configJson.containsKey("drive")) {
+    auto driveInfo = configJson["drive"];
+    config.driveConfig.rightInverted = driveInfo["rightInverted"] | config.driveConfig.rightInverted;
+  }
+
   if (shouldWrite) {
     writeConfigToDisk(config);
   }
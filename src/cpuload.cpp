@@ -0,0 +1,122 @@
+#include "cpuload.h"
+
+#include <Arduino.h>
+
+namespace xrp {
+
+struct CoreLoad {
+  unsigned long windowStartUs;
+  unsigned long busyUs;
+  unsigned long taskUs[XRP_CPU_NUM_TASKS];
+  unsigned long taskMaxUs[XRP_CPU_NUM_TASKS];
+
+  // Results from the last complete window(s)
+  unsigned long lastTaskUs[XRP_CPU_NUM_TASKS];
+  unsigned long lastTaskMaxUs[XRP_CPU_NUM_TASKS];
+  float utilization;
+  float history[XRP_CPU_LONG_WINDOW_COUNT];
+  int historyIdx;
+  int historyCount;
+  float utilizationLong;
+  unsigned long windowCount;
+};
+
+// Each core only writes its own entry
+CoreLoad _coreLoad[2];
+
+const char* _cpuTaskNames[XRP_CPU_NUM_TASKS] = {
+  "web",
+  "udp",
+  "imu",
+  "robot",
+  "telemetry",
+  "rangefinder",
+  "sysid"
+};
+
+void _cpuloadRollWindow(CoreLoad& load, unsigned long now) {
+  unsigned long elapsed = now - load.windowStartUs;
+
+  load.utilization = (100.0f * load.busyUs) / elapsed;
+  if (load.utilization > 100.0f) {
+    load.utilization = 100.0f;
+  }
+
+  load.history[load.historyIdx] = load.utilization;
+  load.historyIdx = (load.historyIdx + 1) % XRP_CPU_LONG_WINDOW_COUNT;
+  if (load.historyCount < XRP_CPU_LONG_WINDOW_COUNT) {
+    load.historyCount++;
+  }
+
+  float sum = 0;
+  for (int i = 0; i < load.historyCount; i++) {
+    sum += load.history[i];
+  }
+  load.utilizationLong = sum / load.historyCount;
+
+  for (int i = 0; i < XRP_CPU_NUM_TASKS; i++) {
+    load.lastTaskUs[i] = load.taskUs[i];
+    load.taskUs[i] = 0;
+    load.lastTaskMaxUs[i] = load.taskMaxUs[i];
+    load.taskMaxUs[i] = 0;
+  }
+
+  load.busyUs = 0;
+  load.windowStartUs = now;
+  load.windowCount++;
+}
+
+void cpuloadTaskEnd(uint8_t taskId, unsigned long startUs, bool didWork) {
+  if (!didWork || taskId >= XRP_CPU_NUM_TASKS) return;
+
+  CoreLoad& load = _coreLoad[get_core_num()];
+  unsigned long elapsed = micros() - startUs;
+  load.busyUs += elapsed;
+  load.taskUs[taskId] += elapsed;
+  if (elapsed > load.taskMaxUs[taskId]) {
+    load.taskMaxUs[taskId] = elapsed;
+  }
+}
+
+void cpuloadPeriodic() {
+  CoreLoad& load = _coreLoad[get_core_num()];
+  unsigned long now = micros();
+
+  if (load.windowStartUs == 0) {
+    load.windowStartUs = now;
+    return;
+  }
+
+  if (now - load.windowStartUs >= XRP_CPU_WINDOW_US) {
+    _cpuloadRollWindow(load, now);
+  }
+}
+
+float cpuloadUtilization(int core) {
+  return _coreLoad[core].utilization;
+}
+
+float cpuloadUtilizationLong(int core) {
+  return _coreLoad[core].utilizationLong;
+}
+
+unsigned long cpuloadTaskTimeUs(int core, uint8_t taskId) {
+  if (taskId >= XRP_CPU_NUM_TASKS) return 0;
+  return _coreLoad[core].lastTaskUs[taskId];
+}
+
+unsigned long cpuloadTaskMaxUs(int core, uint8_t taskId) {
+  if (taskId >= XRP_CPU_NUM_TASKS) return 0;
+  return _coreLoad[core].lastTaskMaxUs[taskId];
+}
+
+const char* cpuloadTaskName(uint8_t taskId) {
+  if (taskId >= XRP_CPU_NUM_TASKS) return "unknown";
+  return _cpuTaskNames[taskId];
+}
+
+unsigned long cpuloadWindowCount() {
+  return _coreLoad[0].windowCount;
+}
+
+} // namespace xrp
@@ -0,0 +1,221 @@
+#include "crashlog.h"
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include <hardware/structs/vreg_and_chip_reset.h>
+#include <hardware/watchdog.h>
+
+#define CRASHLOG_MAGIC 0x58525043 // "XRPC"
+#define CRASHLOG_FILE "/crashlog.txt"
+
+namespace xrp {
+
+struct CrashSpan {
+  uint32_t timeUs;
+  uint8_t spanId;
+};
+
+struct CrashRecord {
+  uint32_t magic;
+  uint32_t reason;
+
+  // Hard fault info
+  uint32_t faultCore;
+  uint32_t faultUptimeMs;
+  uint32_t regs[8]; // r0 r1 r2 r3 r12 lr pc xpsr
+  uint32_t stack[XRP_CRASHLOG_STACK_WORDS];
+
+  // Updated continuously while running
+  CrashSpan spans[2][XRP_CRASHLOG_NUM_SPANS];
+  uint32_t spanIdx[2];
+  uint32_t avgLoopUs;
+  uint32_t maxLoopUs;
+
+  uint32_t magicCheck;
+};
+
+// This lives in RAM that the runtime doesn't zero on boot, so whatever we
+// wrote before a reset is still there afterwards (unless power was lost)
+CrashRecord _crashRecord __attribute__((section(".uninitialized_data.crashlog")));
+
+// Copy of the record from the previous run
+CrashRecord _prevCrashRecord;
+bool _prevCrashRecordValid = false;
+bool _prevCrashRecordPending = false;
+ResetReason _resetReason = RESET_REASON_UNKNOWN;
+
+const char* _resetReasonStrings[] = {
+  "Power On",
+  "Brownout",
+  "Reset Pin",
+  "Watchdog",
+  "Hard Fault",
+  "Unknown"
+};
+
+bool _crashRecordValid(const CrashRecord& rec) {
+  return rec.magic == CRASHLOG_MAGIC && rec.magicCheck == ~(uint32_t)CRASHLOG_MAGIC;
+}
+
+void crashlogInit() {
+  bool hadPOR = vreg_and_chip_reset_hw->chip_reset & VREG_AND_CHIP_RESET_CHIP_RESET_HAD_POR_BITS;
+  bool hadRun = vreg_and_chip_reset_hw->chip_reset & VREG_AND_CHIP_RESET_CHIP_RESET_HAD_RUN_BITS;
+
+  _prevCrashRecordValid = _crashRecordValid(_crashRecord);
+
+  if (_prevCrashRecordValid && _crashRecord.reason == RESET_REASON_HARD_FAULT) {
+    _resetReason = RESET_REASON_HARD_FAULT;
+  }
+  else if (watchdog_enable_caused_reboot()) {
+    _resetReason = RESET_REASON_WATCHDOG;
+  }
+  else if (hadPOR) {
+    // If RAM survived a power-on reset, the supply only dipped
+    _resetReason = _prevCrashRecordValid ? RESET_REASON_BROWNOUT : RESET_REASON_POWER_ON;
+  }
+  else if (hadRun) {
+    _resetReason = RESET_REASON_RESET_PIN;
+  }
+  else {
+    _resetReason = RESET_REASON_UNKNOWN;
+  }
+
+  // Only keep records from resets that we didn't ask for
+  if (_prevCrashRecordValid &&
+      (_resetReason == RESET_REASON_HARD_FAULT ||
+       _resetReason == RESET_REASON_WATCHDOG ||
+       _resetReason == RESET_REASON_BROWNOUT)) {
+    memcpy(&_prevCrashRecord, &_crashRecord, sizeof(CrashRecord));
+    _prevCrashRecord.reason = _resetReason;
+    _prevCrashRecordPending = true;
+  }
+  else {
+    _prevCrashRecordValid = false;
+  }
+
+  // Arm the record for this run
+  memset(&_crashRecord, 0, sizeof(CrashRecord));
+  _crashRecord.reason = RESET_REASON_UNKNOWN;
+  _crashRecord.magic = CRASHLOG_MAGIC;
+  _crashRecord.magicCheck = ~(uint32_t)CRASHLOG_MAGIC;
+}
+
+void crashlogPersist() {
+  Serial.printf("[CRASH] Reset reason: %s\n", crashlogResetReasonString());
+
+  if (!_prevCrashRecordPending) return;
+  _prevCrashRecordPending = false;
+
+  const CrashRecord& rec = _prevCrashRecord;
+  File f = LittleFS.open(CRASHLOG_FILE, "w");
+  if (!f) {
+    Serial.println("[CRASH] Failed to open crash log for writing");
+    return;
+  }
+
+  f.printf("Reset Reason: %s\n", _resetReasonStrings[rec.reason]);
+  f.printf("Avg Loop Time (us): %lu\n", (unsigned long)rec.avgLoopUs);
+  f.printf("Max Loop Time (us): %lu\n", (unsigned long)rec.maxLoopUs);
+
+  if (rec.reason == RESET_REASON_HARD_FAULT) {
+    const char* regNames[] = {"r0", "r1", "r2", "r3", "r12", "lr", "pc", "xpsr"};
+    f.printf("Fault Core: %lu\n", (unsigned long)rec.faultCore);
+    f.printf("Fault Uptime (ms): %lu\n", (unsigned long)rec.faultUptimeMs);
+    for (int i = 0; i < 8; i++) {
+      f.printf("%s: 0x%08lx\n", regNames[i], (unsigned long)rec.regs[i]);
+    }
+
+    f.print("Stack:");
+    for (int i = 0; i < XRP_CRASHLOG_STACK_WORDS; i++) {
+      f.printf(" %08lx", (unsigned long)rec.stack[i]);
+    }
+    f.print("\n");
+  }
+
+  // Spans, oldest first
+  for (int core = 0; core < 2; core++) {
+    f.printf("Core %d Spans (id@us):", core);
+    for (int i = 0; i < XRP_CRASHLOG_NUM_SPANS; i++) {
+      const CrashSpan& span = rec.spans[core][(rec.spanIdx[core] + i) % XRP_CRASHLOG_NUM_SPANS];
+      if (span.spanId == 0) continue;
+      f.printf(" %02x@%lu", span.spanId, (unsigned long)span.timeUs);
+    }
+    f.print("\n");
+  }
+
+  f.close();
+  Serial.println("[CRASH] Previous run ended unexpectedly. Details saved to " CRASHLOG_FILE);
+}
+
+bool crashlogAvailable() {
+  return LittleFS.exists(CRASHLOG_FILE);
+}
+
+ResetReason crashlogResetReason() {
+  return _resetReason;
+}
+
+const char* crashlogResetReasonString() {
+  return _resetReasonStrings[_resetReason];
+}
+
+void crashlogMark(uint8_t spanId) {
+  // Each core only ever touches its own ring, so no locking needed
+  uint core = get_core_num();
+  uint32_t idx = _crashRecord.spanIdx[core];
+  _crashRecord.spans[core][idx].timeUs = time_us_32();
+  _crashRecord.spans[core][idx].spanId = spanId;
+  _crashRecord.spanIdx[core] = (idx + 1) % XRP_CRASHLOG_NUM_SPANS;
+}
+
+void crashlogUpdateLoopStats(unsigned long avgLoopUs, unsigned long maxLoopUs) {
+  _crashRecord.avgLoopUs = avgLoopUs;
+  _crashRecord.maxLoopUs = maxLoopUs;
+}
+
+} // namespace xrp
+
+// Called from the hard fault handler below with a pointer to the exception
+// stack frame
+extern "C" void _xrpHardFaultHandler(uint32_t* frame) {
+  xrp::CrashRecord& rec = xrp::_crashRecord;
+  rec.reason = xrp::RESET_REASON_HARD_FAULT;
+  rec.faultCore = get_core_num();
+  rec.faultUptimeMs = to_ms_since_boot(get_absolute_time());
+
+  for (int i = 0; i < 8; i++) {
+    rec.regs[i] = frame[i];
+  }
+
+  // Whatever was on the stack before the fault. Don't read past the end of
+  // RAM, or we'll fault again inside the fault handler
+  for (int i = 0; i < XRP_CRASHLOG_STACK_WORDS; i++) {
+    uint32_t* addr = frame + 8 + i;
+    rec.stack[i] = (uintptr_t)addr < SRAM_END ? *addr : 0;
+  }
+
+  rec.magic = CRASHLOG_MAGIC;
+  rec.magicCheck = ~(uint32_t)CRASHLOG_MAGIC;
+
+  watchdog_reboot(0, 0, 0);
+  while (true);
+}
+
+// Overrides the SDK's default (breakpoint) handler. Figure out which stack
+// the exception frame was pushed to and pass it along
+extern "C" __attribute__((naked)) void isr_hardfault() {
+  asm volatile(
+    "movs r0, #4\n"
+    "mov r1, lr\n"
+    "tst r0, r1\n"
+    "beq 1f\n"
+    "mrs r0, psp\n"
+    "b 2f\n"
+    "1:\n"
+    "mrs r0, msp\n"
+    "2:\n"
+    "ldr r1, =_xrpHardFaultHandler\n"
+    "bx r1\n"
+  );
+}
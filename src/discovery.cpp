@@ -0,0 +1,45 @@
+#include "discovery.h"
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+
+namespace xrp {
+
+WiFiUDP _discoveryUdp;
+unsigned long _lastDiscoveryPoll = 0;
+unsigned long _discoveryQueryCount = 0;
+
+void discoveryBegin() {
+  // Bound to the port, so broadcasts are picked up as well
+  _discoveryUdp.beginMulticast(IPAddress(XRP_DISCOVERY_MULTICAST_GROUP), XRP_DISCOVERY_PORT);
+  Serial.printf("[NET] Discovery listening on port %d\n", XRP_DISCOVERY_PORT);
+}
+
+bool discoveryPoll() {
+  if (millis() - _lastDiscoveryPoll < XRP_DISCOVERY_POLL_MS) return false;
+  _lastDiscoveryPoll = millis();
+
+  // Only one query is answered per poll, so a flood of queries can't take
+  // over the loop. The rest get dropped by the next parsePacket()
+  int packetSize = _discoveryUdp.parsePacket();
+  if (packetSize != sizeof(XRP_DISCOVERY_QUERY) - 1) return false;
+
+  char query[sizeof(XRP_DISCOVERY_QUERY) - 1];
+  if (_discoveryUdp.read(query, sizeof(query)) != sizeof(query)) return false;
+  if (memcmp(query, XRP_DISCOVERY_QUERY, sizeof(query)) != 0) return false;
+
+  _discoveryQueryCount++;
+  return true;
+}
+
+void discoveryReply(const char* reply, size_t len) {
+  _discoveryUdp.beginPacket(_discoveryUdp.remoteIP(), _discoveryUdp.remotePort());
+  _discoveryUdp.write(reply, len);
+  _discoveryUdp.endPacket();
+}
+
+unsigned long discoveryQueryCount() {
+  return _discoveryQueryCount;
+}
+
+} // namespace xrp
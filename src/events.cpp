@@ -0,0 +1,62 @@
+#include "events.h"
+
+#include <Arduino.h>
+
+namespace xrp {
+
+XRPEvent _eventQueue[XRP_EVENT_QUEUE_SIZE];
+int _eventHead = 0;
+int _eventCount = 0;
+uint16_t _nextEventId = 0;
+
+unsigned long _lastEventSendTime = 0;
+bool _eventsUnsent = false;
+unsigned long _eventsDropped = 0;
+
+void eventsPost(uint8_t cause, uint8_t detail) {
+  if (_eventCount == XRP_EVENT_QUEUE_SIZE) {
+    // Nobody is picking them up. Make room by losing the oldest
+    _eventHead = (_eventHead + 1) % XRP_EVENT_QUEUE_SIZE;
+    _eventCount--;
+    _eventsDropped++;
+  }
+
+  XRPEvent& evt = _eventQueue[(_eventHead + _eventCount) % XRP_EVENT_QUEUE_SIZE];
+  evt.id = _nextEventId++;
+  evt.cause = cause;
+  evt.detail = detail;
+  evt.timeMs = millis();
+  _eventCount++;
+
+  _eventsUnsent = true;
+}
+
+bool eventsDue() {
+  if (_eventCount == 0) return false;
+  return _eventsUnsent || millis() - _lastEventSendTime >= XRP_EVENT_RETRANSMIT_MS;
+}
+
+int eventsPending(XRPEvent* out, int maxEvents) {
+  int n = _eventCount < maxEvents ? _eventCount : maxEvents;
+  for (int i = 0; i < n; i++) {
+    out[i] = _eventQueue[(_eventHead + i) % XRP_EVENT_QUEUE_SIZE];
+  }
+  return n;
+}
+
+void eventsMarkSent() {
+  _eventsUnsent = false;
+  _lastEventSendTime = millis();
+}
+
+void eventsMarkDelivered() {
+  _eventHead = 0;
+  _eventCount = 0;
+  _eventsUnsent = false;
+}
+
+unsigned long eventsDroppedCount() {
+  return _eventsDropped;
+}
+
+} // namespace xrp
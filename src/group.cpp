@@ -0,0 +1,281 @@
+#include "group.h"
+#include "byteutils.h"
+#include "udpguard.h"
+#include "wpilibudp.h"
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <cstring>
+
+// Late by more than this counts as a missed schedule
+#define GROUP_LATE_THRESHOLD_MS 5
+
+namespace xrp {
+
+struct GroupCommand {
+  bool pending;
+  unsigned long applyAtMs; // Our clock
+  int len;
+  char data[XRP_GROUP_MAX_COMMAND_BYTES];
+};
+
+WiFiUDP _groupUdp;
+bool _groupEnabled = false;
+int _groupRobotId = 0;
+int _groupIndex = 0;
+IPAddress _groupSender;
+
+char _groupPacketBuf[512];
+uint16_t _groupMaxSeq = 0;
+
+bool _groupClockSynced = false;
+int32_t _groupClockOffsetMs = 0;
+
+GroupCommand _groupQueue[XRP_GROUP_QUEUE_SIZE];
+
+bool _groupUnicastActive = false;
+
+unsigned long _groupPacketCount = 0;
+unsigned long _groupCommandsApplied = 0;
+unsigned long _groupCommandsLate = 0;
+
+void groupBegin(const char* address, int port, int robotId, int groupIndex, const char* sender) {
+  IPAddress groupAddr;
+  if (!groupAddr.fromString(address)) {
+    Serial.printf("[GROUP] Invalid group address %s\n", address);
+    return;
+  }
+
+  // Anyone on the network can send to the group, so only listen to the one
+  // sender we were told about
+  if (!_groupSender.fromString(sender)) {
+    Serial.printf("[GROUP] Invalid or missing group sender '%s'. Not joining\n", sender);
+    return;
+  }
+
+  _groupUdp.beginMulticast(groupAddr, port);
+  _groupRobotId = robotId;
+  _groupIndex = groupIndex;
+  _groupEnabled = true;
+  Serial.printf("[GROUP] Joined %s:%d as robot %d in group %d (sender %s)\n", address, port, robotId, groupIndex, sender);
+}
+
+bool groupEnabled() {
+  return _groupEnabled;
+}
+
+void _updateGroupClock(uint32_t senderMs) {
+  // Network delay only ever makes the sample smaller, so the largest sample
+  // is the best one. Drift down slowly so that a slow sender clock is followed
+  int32_t sample = (int32_t)(senderMs - millis());
+  if (!_groupClockSynced || sample > _groupClockOffsetMs) {
+    _groupClockOffsetMs = sample;
+    _groupClockSynced = true;
+  }
+  else {
+    _groupClockOffsetMs--;
+  }
+}
+
+bool _groupTargetMatches(uint8_t targetType, uint8_t target) {
+  switch (targetType) {
+    case XRP_GROUP_TARGET_ALL:
+      return true;
+    case XRP_GROUP_TARGET_ROBOT:
+      return target == _groupRobotId;
+    case XRP_GROUP_TARGET_GROUP:
+      return target == _groupIndex;
+    default:
+      return false;
+  }
+}
+
+// Group commands can only drive outputs. Anything that reconfigures the
+// robot (or starts a SysId test) needs a host talking to it directly
+bool _groupTagAllowed(uint8_t tag) {
+  switch (tag) {
+    case XRP_TAG_MOTOR:
+    case XRP_TAG_SERVO:
+    case XRP_TAG_DIO:
+    case XRP_TAG_ACTUATORS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void _applyGroupCommand(char* data, int len) {
+  int startIdx = 0;
+  while (startIdx < len) {
+    int msgSize = (uint8_t)data[startIdx];
+    int endIdx = startIdx + msgSize + 1;
+    if (endIdx > len || msgSize == 0) break;
+
+    if (_groupTagAllowed((uint8_t)data[startIdx+1])) {
+      wpilibudp::processTags(data, startIdx, endIdx);
+    }
+    startIdx = endIdx;
+  }
+  _groupCommandsApplied++;
+}
+
+void _queueGroupCommand(unsigned long applyAtMs, char* data, int len) {
+  if (len > XRP_GROUP_MAX_COMMAND_BYTES) {
+    Serial.printf("[GROUP] Scheduled command too large (%d bytes)\n", len);
+    return;
+  }
+
+  for (int i = 0; i < XRP_GROUP_QUEUE_SIZE; i++) {
+    GroupCommand& cmd = _groupQueue[i];
+    if (cmd.pending) continue;
+
+    cmd.pending = true;
+    cmd.applyAtMs = applyAtMs;
+    cmd.len = len;
+    memcpy(cmd.data, data, len);
+    return;
+  }
+
+  Serial.println("[GROUP] Schedule queue full. Dropping command");
+}
+
+void _processGroupCommand(char* buffer, int start, int end) {
+  // tag(1) targetType(1) target(1) applyAtMs(4) tagged data(n)
+  if (end - start < 7) return;
+
+  if (!_groupTargetMatches(buffer[start+1], buffer[start+2])) return;
+
+  uint32_t applyAtSender = networkToUInt32(buffer, start+3);
+  char* data = buffer + start + 7;
+  int len = end - (start + 7);
+
+  // 0 means now. So does any schedule before we've heard the sender's time
+  if (applyAtSender == 0 || !_groupClockSynced) {
+    _applyGroupCommand(data, len);
+    return;
+  }
+
+  unsigned long applyAt = applyAtSender - _groupClockOffsetMs;
+  long untilApply = (long)(applyAt - millis());
+  if (untilApply <= 0) {
+    if (-untilApply > GROUP_LATE_THRESHOLD_MS) {
+      _groupCommandsLate++;
+    }
+    _applyGroupCommand(data, len);
+  }
+  else if (untilApply <= XRP_GROUP_MAX_SCHEDULE_MS) {
+    _queueGroupCommand(applyAt, data, len);
+  }
+}
+
+void _processGroupPacket(char* buffer, int size) {
+  if (size < 3) return;
+
+  // Same sequence handling as the unicast channel, tracked separately
+  uint16_t seq = networkToUInt16(buffer);
+  if (seq > _groupMaxSeq || 65535 - seq < 5) {
+    _groupMaxSeq = seq;
+  }
+  else {
+    return;
+  }
+
+  _groupPacketCount++;
+
+  // The control byte is for the whole fleet, whoever the commands are for
+  wpilibudp::applyControl(buffer[2]);
+
+  int startIdx = 3;
+  while (startIdx < size) {
+    int msgSize = (uint8_t)buffer[startIdx];
+    int endIdx = startIdx + msgSize + 1;
+    if (endIdx > size || msgSize == 0) break;
+
+    int tagIdx = startIdx + 1;
+    switch ((uint8_t)buffer[tagIdx]) {
+      case XRP_TAG_GROUP_TIME:
+        // tag(1) senderMs(4)
+        if (endIdx - tagIdx >= 5) {
+          _updateGroupClock(networkToUInt32(buffer, tagIdx+1));
+        }
+        break;
+      case XRP_TAG_GROUP_COMMAND:
+        _processGroupCommand(buffer, tagIdx, endIdx);
+        break;
+      default:
+        // Anything else is unicast only
+        break;
+    }
+
+    startIdx = endIdx;
+  }
+}
+
+void groupPoll(bool unicastActive) {
+  if (!_groupEnabled) return;
+
+  // Nothing the fleet scheduled should fire on top of the new host
+  if (unicastActive && !_groupUnicastActive) {
+    for (int i = 0; i < XRP_GROUP_QUEUE_SIZE; i++) {
+      _groupQueue[i].pending = false;
+    }
+  }
+  _groupUnicastActive = unicastActive;
+
+  for (int i = 0; i < XRP_GROUP_MAX_PACKETS_PER_LOOP; i++) {
+    int packetSize = _groupUdp.parsePacket();
+    if (!packetSize) break;
+
+    // A host talking to us directly takes priority over the fleet
+    if (unicastActive) continue;
+
+    if (_groupUdp.remoteIP() != _groupSender) continue;
+    if (udpGuardCheck(_groupUdp.remoteIP(), _groupUdp.remotePort(), false, 0, 0) != UDP_ADMIT) continue;
+
+    int n = _groupUdp.read(_groupPacketBuf, sizeof(_groupPacketBuf));
+    _processGroupPacket(_groupPacketBuf, n);
+  }
+}
+
+void groupPeriodic() {
+  if (!_groupEnabled || _groupUnicastActive) return;
+
+  unsigned long now = millis();
+  for (int i = 0; i < XRP_GROUP_QUEUE_SIZE; i++) {
+    GroupCommand& cmd = _groupQueue[i];
+    if (!cmd.pending) continue;
+    if ((long)(now - cmd.applyAtMs) < 0) continue;
+
+    if (now - cmd.applyAtMs > GROUP_LATE_THRESHOLD_MS) {
+      _groupCommandsLate++;
+    }
+    _applyGroupCommand(cmd.data, cmd.len);
+    cmd.pending = false;
+  }
+}
+
+void groupResetState() {
+  _groupMaxSeq = 0;
+}
+
+bool groupClockSynced() {
+  return _groupClockSynced;
+}
+
+int32_t groupClockOffsetMs() {
+  return _groupClockOffsetMs;
+}
+
+unsigned long groupPacketCount() {
+  return _groupPacketCount;
+}
+
+unsigned long groupCommandsApplied() {
+  return _groupCommandsApplied;
+}
+
+unsigned long groupCommandsLate() {
+  return _groupCommandsLate;
+}
+
+} // namespace xrp
@@ -1,10 +1,34 @@
 #include "imu.h"
+#include "events.h"
+#include "liveness.h"
 
+#include <LittleFS.h>
 #include <MadgwickAHRS.h>
 
 #define IMU_DEFAULT_CALIBRATION_TIME_MS 3000
-
-#define IMU_MADGWICK_LOOP_FREQ_HZ 25
+#define IMU_BIAS_MODEL_FILE "/gyrobias.txt"
+#define IMU_BIAS_NUM_BINS (IMU_BIAS_MAX_TEMP_C - IMU_BIAS_MIN_TEMP_C + 1)
+
+// LSM6DSOX control registers used for the on-chip filters
+#define LSM6DSOX_REG_CTRL1_XL 0x10
+#define LSM6DSOX_REG_CTRL4_C 0x13
+#define LSM6DSOX_REG_CTRL6_C 0x15
+
+#define LSM6DSOX_CTRL1_XL_LPF2_XL_EN 0x02
+#define LSM6DSOX_CTRL4_C_LPF1_SEL_G 0x02
+#define LSM6DSOX_CTRL6_C_FTYPE_MASK 0x07
+
+// LSM6DSOX registers used for motion events
+#define LSM6DSOX_REG_WAKE_UP_SRC 0x1B
+#define LSM6DSOX_REG_TAP_CFG0 0x56
+#define LSM6DSOX_REG_TAP_CFG2 0x58
+#define LSM6DSOX_REG_WAKE_UP_THS 0x5B
+#define LSM6DSOX_REG_WAKE_UP_DUR 0x5C
+#define LSM6DSOX_REG_FREE_FALL 0x5D
+
+#define LSM6DSOX_WAKE_UP_SRC_FF_IA 0x20
+#define LSM6DSOX_WAKE_UP_SRC_WU_IA 0x08
+#define LSM6DSOX_WAKE_UP_SRC_AXES 0x07
 
 namespace xrp {
 
@@ -25,8 +49,60 @@ float _gyroAnglesDeg[3] = {0, 0, 0};
 
 float _ahrsOffsets[3] = {0, 0, 0};
 
+// Gyro bias tracking. The anchor is the last measured bias and the
+// temperature it was measured at. The slope carries it to other temperatures
+float _imuTempC = 0;
+float _gyroBiasAnchorDPS[3] = {0, 0, 0};
+float _gyroBiasAnchorTempC = 0;
+float _gyroBiasSlope[3] = {0, 0, 0}; // DPS per C
+bool _gyroBiasSlopeValid = false;
+float _gyroBiasBins[IMU_BIAS_NUM_BINS][3];
+bool _gyroBiasBinValid[IMU_BIAS_NUM_BINS] = {false};
+bool _gyroBiasDirty = false;
+bool _gyroBiasLearning = false;
+unsigned long _gyroBiasLastSave = 0;
+
+unsigned long _biasWindowStart = 0;
+int _biasWindowCount = 0;
+float _biasWindowSums[3] = {0, 0, 0};
+float _biasWindowMin[3];
+float _biasWindowMax[3];
+float _biasWindowTempSum = 0;
+
+void _gyroBiasModelLoad();
+void _biasWindowReset();
+
+// Non-blocking recalibration
+IMUCalibrationState _imuCalState = IMU_CAL_IDLE;
+unsigned long _imuCalStartTime = 0;
+unsigned long _imuCalDurationMs = 0;
+unsigned long _imuCalEndTime = 0;
+float _imuCalGyroSums[3] = {0, 0, 0};
+int _imuCalNumVals = 0;
+
+// Sensor settings
+int _imuOdrHz = IMU_DEFAULT_ODR_HZ;
+
+// Motion events
+TwoWire* _imuWire = nullptr;
+uint8_t _imuAddr = 0;
+uint8_t _tiltThresholdDeg = 0;
+int _tiltSampleCount = 0;
+bool _tilted = false;
+uint8_t _motionEvents = 0;
+uint8_t _lastImpactAxes = 0;
+uint8_t _motionCutoffMask = 0;
+uint16_t _motionImpactMg = 0;
+uint16_t _motionFreeFallMs = 0;
+
+// AHRS convergence
+float _ahrsSeedAccelG[3] = {0, 0, 1};
+bool _ahrsConverged = false;
+int _ahrsSettleCount = 0;
+
 Madgwick _ahrsFilter;
 bool _filterStarted = false;
+int _filterRateHz = IMU_MADGWICK_LOOP_FREQ_HZ;
 unsigned long _microsPerReading, _microsPrevious;
 
 float _radToDeg(float angleRad) {
@@ -69,8 +145,13 @@ void imuInit(uint8_t addr, TwoWire *theWire) {
   }
   else {
     _imuReady = true;
+    _imuWire = theWire;
+    _imuAddr = addr;
     Serial.println("--- IMU ---");
     Serial.println("LSM6DSOX detected");
+
+    _gyroBiasModelLoad();
+    _biasWindowReset();
     
     Serial.println("Setting update rate to 208Hz");
     _lsm6.setGyroDataRate(LSM6DS_RATE_208_HZ);
@@ -116,7 +197,7 @@ void imuInit(uint8_t addr, TwoWire *theWire) {
 }
 
 void imuCalibrate(unsigned long calibrationTimeMs) {
-  unsigned long loopDelayTime = 1000 / 208;
+  unsigned long loopDelayTime = _imuOdrHz >= 1000 ? 1 : 1000 / _imuOdrHz;
 
   if (calibrationTimeMs == 0) {
     calibrationTimeMs = IMU_DEFAULT_CALIBRATION_TIME_MS;
@@ -126,6 +207,7 @@ void imuCalibrate(unsigned long calibrationTimeMs) {
   
   float gyroAvgValues[3] = {0, 0, 0};
   float accelAvgValues[3] = {0, 0, 0};
+  float tempAvgValue = 0;
 
   int numVals = 0;
 
@@ -161,22 +243,39 @@ void imuCalibrate(unsigned long calibrationTimeMs) {
     gyroAvgValues[1] += _radToDeg(gyro.gyro.y);
     gyroAvgValues[2] += _radToDeg(gyro.gyro.z);
 
+    tempAvgValue += temp.temperature;
+
     numVals++;
     delay(loopDelayTime);
   }
 
-  _accelOffsetsG[0] = accelAvgValues[0] / numVals;
-  _accelOffsetsG[1] = accelAvgValues[1] / numVals;
-  _accelOffsetsG[2] = accelAvgValues[2] / numVals;
+  // Starting orientation for the filter. This is where gravity really is,
+  // so take it before anything is subtracted
+  for (int i = 0; i < 3; i++) {
+    _ahrsSeedAccelG[i] = accelAvgValues[i] / numVals;
+  }
 
   _gyroOffsetsDPS[0] = gyroAvgValues[0] / numVals;
   _gyroOffsetsDPS[1] = gyroAvgValues[1] / numVals;
   _gyroOffsetsDPS[2] = gyroAvgValues[2] / numVals;
 
-  // Remove 1G from the vertical axis (assumed to be Z)
-  _accelOffsetsG[2] -= 1.0;
+  _imuTempC = tempAvgValue / numVals;
+  for (int i = 0; i < 3; i++) {
+    _gyroBiasAnchorDPS[i] = _gyroOffsetsDPS[i];
+  }
+  _gyroBiasAnchorTempC = _imuTempC;
+
+  // The board may not be level, so don't assume gravity is on Z. Only
+  // remove the error in its magnitude, keeping its direction (the tilt)
+  float seedMag = sqrtf(_ahrsSeedAccelG[0] * _ahrsSeedAccelG[0] +
+      _ahrsSeedAccelG[1] * _ahrsSeedAccelG[1] +
+      _ahrsSeedAccelG[2] * _ahrsSeedAccelG[2]);
+  for (int i = 0; i < 3; i++) {
+    _accelOffsetsG[i] = seedMag > 0 ? _ahrsSeedAccelG[i] - (_ahrsSeedAccelG[i] / seedMag) : 0;
+  }
 
-  Serial.printf("[IMU] Gyro Offsets(dps): X(%f) Y(%f) Z(%f), Accel Offsets(g): X(%f) Y(%f) Z(%f)\n",
+  Serial.printf("[IMU] Gyro Offsets(dps) at %.1fC: X(%f) Y(%f) Z(%f), Accel Offsets(g): X(%f) Y(%f) Z(%f)\n",
+      _imuTempC,
       _gyroOffsetsDPS[0],
       _gyroOffsetsDPS[1],
       _gyroOffsetsDPS[2],
@@ -188,18 +287,591 @@ void imuCalibrate(unsigned long calibrationTimeMs) {
   digitalWrite(LED_BUILTIN, LOW);
 }
 
+/**
+ * Start a gyro bias recalibration in the background.
+ *
+ * Samples are collected from imuPeriodic() while the robot keeps running.
+ * The robot must stay still; if motion is detected the calibration is
+ * abandoned and the existing offsets are kept.
+ */
+bool imuStartCalibration(unsigned long calibrationTimeMs) {
+  if (!_imuReady || _imuCalState == IMU_CAL_RUNNING) {
+    return false;
+  }
+
+  if (calibrationTimeMs == 0) {
+    calibrationTimeMs = IMU_DEFAULT_CALIBRATION_TIME_MS;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    _imuCalGyroSums[i] = 0;
+  }
+  _imuCalNumVals = 0;
+  _imuCalDurationMs = calibrationTimeMs;
+  _imuCalStartTime = millis();
+  _imuCalState = IMU_CAL_RUNNING;
+
+  Serial.printf("[IMU] Beginning background calibration. Running for %lu ms\n", calibrationTimeMs);
+  return true;
+}
+
+// Give the host some time to see the final state before going idle. Done
+// here rather than per sample so the status still ages out with no IMU data
+void _imuCalibrationAgeOut() {
+  if (_imuCalState == IMU_CAL_COMPLETE || _imuCalState == IMU_CAL_FAILED) {
+    if (millis() - _imuCalEndTime > IMU_CAL_STATUS_HOLD_MS) {
+      _imuCalState = IMU_CAL_IDLE;
+    }
+  }
+}
+
+IMUCalibrationState imuGetCalibrationState() {
+  _imuCalibrationAgeOut();
+  return _imuCalState;
+}
+
+/**
+ * Get the progress of the current calibration
+ *
+ * @return Progress (0 to 100)
+ */
+uint8_t imuGetCalibrationProgress() {
+  _imuCalibrationAgeOut();
+  if (_imuCalState != IMU_CAL_RUNNING) {
+    return _imuCalState == IMU_CAL_COMPLETE ? 100 : 0;
+  }
+
+  unsigned long elapsed = millis() - _imuCalStartTime;
+  if (elapsed >= _imuCalDurationMs) {
+    return 100;
+  }
+  return (elapsed * 100) / _imuCalDurationMs;
+}
+
+void _imuCalibrationFinish(IMUCalibrationState result) {
+  _imuCalState = result;
+  _imuCalEndTime = millis();
+  digitalWrite(LED_BUILTIN, LOW);
+}
+
+// Feed one raw sample (gyro in DPS, accel in G) into a running calibration
+void _imuCalibrationUpdate(float gyroDPS[3], float accelG[3]) {
+  if (_imuCalState != IMU_CAL_RUNNING) return;
+
+  // Bail out if we're moving. Compare against the current offsets, which
+  // should only be off by a small amount
+  float accelMag = sqrtf(accelG[0] * accelG[0] + accelG[1] * accelG[1] + accelG[2] * accelG[2]);
+  bool moving = fabsf(accelMag - 1.0f) > IMU_CAL_MOTION_THRESHOLD_G;
+  for (int i = 0; i < 3; i++) {
+    if (fabsf(gyroDPS[i] - _gyroOffsetsDPS[i]) > IMU_CAL_MOTION_THRESHOLD_DPS) {
+      moving = true;
+    }
+  }
+
+  if (moving) {
+    Serial.println("[IMU] Motion detected. Background calibration aborted");
+    eventsPost(XRP_EVENT_GYRO_CAL_FAILED);
+    _imuCalibrationFinish(IMU_CAL_FAILED);
+    return;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    _imuCalGyroSums[i] += gyroDPS[i];
+  }
+  _imuCalNumVals++;
+
+  // Blink the LED like the boot time calibration does
+  digitalWrite(LED_BUILTIN, ((millis() - _imuCalStartTime) / 100) % 2 == 0 ? HIGH : LOW);
+
+  if (millis() - _imuCalStartTime < _imuCalDurationMs) return;
+
+  for (int i = 0; i < 3; i++) {
+    _gyroOffsetsDPS[i] = _imuCalGyroSums[i] / _imuCalNumVals;
+    _gyroBiasAnchorDPS[i] = _gyroOffsetsDPS[i];
+  }
+  _gyroBiasAnchorTempC = _imuTempC;
+
+  Serial.printf("[IMU] Background calibration complete. Gyro Offsets(dps): X(%f) Y(%f) Z(%f)\n",
+      _gyroOffsetsDPS[0],
+      _gyroOffsetsDPS[1],
+      _gyroOffsetsDPS[2]);
+  _imuCalibrationFinish(IMU_CAL_COMPLETE);
+}
+
+// Least squares slope per axis across the learned temperature bins
+void _gyroBiasFitSlope() {
+  int n = 0;
+  int minBin = IMU_BIAS_NUM_BINS;
+  int maxBin = -1;
+  float sumT = 0;
+  float sumTT = 0;
+  float sumB[3] = {0, 0, 0};
+  float sumTB[3] = {0, 0, 0};
+
+  for (int bin = 0; bin < IMU_BIAS_NUM_BINS; bin++) {
+    if (!_gyroBiasBinValid[bin]) continue;
+    float t = bin + IMU_BIAS_MIN_TEMP_C;
+    n++;
+    sumT += t;
+    sumTT += t * t;
+    for (int i = 0; i < 3; i++) {
+      sumB[i] += _gyroBiasBins[bin][i];
+      sumTB[i] += t * _gyroBiasBins[bin][i];
+    }
+    if (bin < minBin) minBin = bin;
+    if (bin > maxBin) maxBin = bin;
+  }
+
+  // A couple of nearby points would give us a very noisy slope
+  if (n < IMU_BIAS_MIN_BINS || maxBin - minBin < IMU_BIAS_MIN_SPAN_C) {
+    _gyroBiasSlopeValid = false;
+    return;
+  }
+
+  float denom = n * sumTT - sumT * sumT;
+  for (int i = 0; i < 3; i++) {
+    _gyroBiasSlope[i] = (n * sumTB[i] - sumT * sumB[i]) / denom;
+  }
+  _gyroBiasSlopeValid = true;
+}
+
+void _gyroBiasModelLoad() {
+  if (!LittleFS.exists(IMU_BIAS_MODEL_FILE)) return;
+
+  File f = LittleFS.open(IMU_BIAS_MODEL_FILE, "r");
+  if (!f) return;
+
+  // One line per bin: temperature(C) biasX biasY biasZ (DPS)
+  int numBins = 0;
+  while (f.available()) {
+    String line = f.readStringUntil('\n');
+    int t;
+    float b[3];
+    if (sscanf(line.c_str(), "%d %f %f %f", &t, &b[0], &b[1], &b[2]) != 4) continue;
+    if (t < IMU_BIAS_MIN_TEMP_C || t > IMU_BIAS_MAX_TEMP_C) continue;
+
+    int bin = t - IMU_BIAS_MIN_TEMP_C;
+    for (int i = 0; i < 3; i++) {
+      _gyroBiasBins[bin][i] = b[i];
+    }
+    _gyroBiasBinValid[bin] = true;
+    numBins++;
+  }
+  f.close();
+
+  _gyroBiasFitSlope();
+  Serial.printf("[IMU] Loaded gyro bias model (%d temperature bins, %s)\n",
+      numBins, _gyroBiasSlopeValid ? "in use" : "not enough data yet");
+}
+
+void imuBiasModelSave() {
+  if (!_gyroBiasDirty) return;
+  if (millis() - _gyroBiasLastSave < IMU_BIAS_SAVE_INTERVAL_MS) return;
+
+  livenessPause();
+  File f = LittleFS.open(IMU_BIAS_MODEL_FILE, "w");
+  if (!f) {
+    livenessResume();
+    Serial.println("[IMU] Failed to save gyro bias model");
+    return;
+  }
+  for (int bin = 0; bin < IMU_BIAS_NUM_BINS; bin++) {
+    if (!_gyroBiasBinValid[bin]) continue;
+    f.printf("%d %f %f %f\n", bin + IMU_BIAS_MIN_TEMP_C,
+        _gyroBiasBins[bin][0], _gyroBiasBins[bin][1], _gyroBiasBins[bin][2]);
+  }
+  f.close();
+  livenessResume();
+
+  _gyroBiasDirty = false;
+  _gyroBiasLastSave = millis();
+}
+
+void imuSetBiasLearning(bool allowed) {
+  _gyroBiasLearning = allowed;
+}
+
+bool imuBiasModelValid() {
+  return _gyroBiasSlopeValid;
+}
+
+float imuGetTemperatureC() {
+  return _imuTempC;
+}
+
+void _biasWindowReset() {
+  _biasWindowStart = millis();
+  _biasWindowCount = 0;
+  _biasWindowTempSum = 0;
+  for (int i = 0; i < 3; i++) {
+    _biasWindowSums[i] = 0;
+    _biasWindowMin[i] = 1e9;
+    _biasWindowMax[i] = -1e9;
+  }
+}
+
+/**
+ * Learn gyro bias whenever the robot sits still. Each window where the raw
+ * rates barely move becomes a bias measurement at the current temperature
+ */
+void _gyroBiasUpdate(float gyroDPS[3], float accelG[3]) {
+  // Don't fight a calibration that is already measuring bias, and don't
+  // learn while something may be turning the robot
+  if (_imuCalState == IMU_CAL_RUNNING || !_gyroBiasLearning) {
+    _biasWindowReset();
+    return;
+  }
+
+  float accelMag = sqrtf(accelG[0] * accelG[0] + accelG[1] * accelG[1] + accelG[2] * accelG[2]);
+  bool moving = fabsf(accelMag - 1.0f) > IMU_CAL_MOTION_THRESHOLD_G;
+  for (int i = 0; i < 3; i++) {
+    if (gyroDPS[i] < _biasWindowMin[i]) _biasWindowMin[i] = gyroDPS[i];
+    if (gyroDPS[i] > _biasWindowMax[i]) _biasWindowMax[i] = gyroDPS[i];
+    if (_biasWindowMax[i] - _biasWindowMin[i] > IMU_BIAS_STATIONARY_SPREAD_DPS) moving = true;
+    if (fabsf(gyroDPS[i] - _gyroOffsetsDPS[i]) > IMU_BIAS_MAX_STEP_DPS) moving = true;
+  }
+
+  if (moving) {
+    _biasWindowReset();
+    return;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    _biasWindowSums[i] += gyroDPS[i];
+  }
+  _biasWindowTempSum += _imuTempC;
+  _biasWindowCount++;
+
+  if (millis() - _biasWindowStart < IMU_BIAS_WINDOW_MS) return;
+
+  float tempC = _biasWindowTempSum / _biasWindowCount;
+  int bin = (int)lroundf(tempC) - IMU_BIAS_MIN_TEMP_C;
+  bool inRange = bin >= 0 && bin < IMU_BIAS_NUM_BINS;
+
+  for (int i = 0; i < 3; i++) {
+    float bias = _biasWindowSums[i] / _biasWindowCount;
+    _gyroBiasAnchorDPS[i] = bias;
+    _gyroOffsetsDPS[i] = bias;
+
+    if (!inRange) continue;
+    if (_gyroBiasBinValid[bin]) {
+      _gyroBiasBins[bin][i] = (_gyroBiasBins[bin][i] * 0.8f) + (bias * 0.2f);
+    }
+    else {
+      _gyroBiasBins[bin][i] = bias;
+    }
+  }
+  _gyroBiasAnchorTempC = tempC;
+
+  if (inRange) {
+    _gyroBiasBinValid[bin] = true;
+    _gyroBiasDirty = true;
+    _gyroBiasFitSlope();
+  }
+
+  _biasWindowReset();
+}
+
+// Carry the last measured bias to the current temperature
+void _gyroBiasApplyModel() {
+  if (!_gyroBiasSlopeValid) return;
+  if (_imuCalState == IMU_CAL_RUNNING) return;
+
+  float dT = _imuTempC - _gyroBiasAnchorTempC;
+  for (int i = 0; i < 3; i++) {
+    _gyroOffsetsDPS[i] = _gyroBiasAnchorDPS[i] + (_gyroBiasSlope[i] * dT);
+  }
+}
+
+void _imuWriteReg(uint8_t reg, uint8_t value) {
+  if (_imuWire == nullptr) return;
+  _imuWire->beginTransmission(_imuAddr);
+  _imuWire->write(reg);
+  _imuWire->write(value);
+  _imuWire->endTransmission();
+}
+
+uint8_t _imuReadReg(uint8_t reg) {
+  if (_imuWire == nullptr) return 0;
+  _imuWire->beginTransmission(_imuAddr);
+  _imuWire->write(reg);
+  _imuWire->endTransmission(false);
+  _imuWire->requestFrom(_imuAddr, (uint8_t)1);
+  return _imuWire->available() ? _imuWire->read() : 0;
+}
+
+void imuConfigureMotionEvents(uint16_t impactMg, uint8_t tiltDeg, uint16_t freeFallMs) {
+  if (!_imuReady) return;
+
+  // Wake-up threshold is in 1/64ths of full scale
+  int fullScaleMg = 4000;
+  switch (_lsm6.getAccelRange()) {
+    case LSM6DS_ACCEL_RANGE_2_G: fullScaleMg = 2000; break;
+    case LSM6DS_ACCEL_RANGE_4_G: fullScaleMg = 4000; break;
+    case LSM6DS_ACCEL_RANGE_8_G: fullScaleMg = 8000; break;
+    case LSM6DS_ACCEL_RANGE_16_G: fullScaleMg = 16000; break;
+  }
+  int wakeThs = impactMg == 0 ? 0 : (impactMg * 64) / fullScaleMg;
+  if (impactMg != 0 && wakeThs == 0) wakeThs = 1;
+  if (wakeThs > 63) wakeThs = 63;
+
+  // Free-fall duration is in accel samples, 6 bits split across two registers.
+  // Threshold is fixed at 312mg (code 3)
+  int ffDur = (freeFallMs * _imuOdrHz) / 1000;
+  if (ffDur > 63) ffDur = 63;
+
+  // Latched, cleared on read, slope filter
+  _imuWriteReg(LSM6DSOX_REG_TAP_CFG0, 0x41);
+  _imuWriteReg(LSM6DSOX_REG_WAKE_UP_THS, wakeThs);
+  _imuWriteReg(LSM6DSOX_REG_WAKE_UP_DUR, (ffDur & 0x20) << 2);
+  _imuWriteReg(LSM6DSOX_REG_FREE_FALL, freeFallMs == 0 ? 0 : (((ffDur & 0x1F) << 3) | 0x03));
+  _imuWriteReg(LSM6DSOX_REG_TAP_CFG2, (impactMg != 0 || freeFallMs != 0) ? 0x80 : 0x00);
+
+  _motionImpactMg = impactMg;
+  _motionFreeFallMs = freeFallMs;
+  _tiltThresholdDeg = tiltDeg;
+  _tiltSampleCount = 0;
+  _tilted = false;
+
+  // Don't report anything that was latched under the old settings
+  _imuReadReg(LSM6DSOX_REG_WAKE_UP_SRC);
+  _motionEvents = 0;
+
+  Serial.printf("[IMU] Motion events: impact %u mg, tilt %u deg, free-fall %u ms\n", impactMg, tiltDeg, freeFallMs);
+}
+
+void _imuMotionUpdate(float accelG[3]) {
+  uint8_t src = _imuReadReg(LSM6DSOX_REG_WAKE_UP_SRC);
+  if (src & LSM6DSOX_WAKE_UP_SRC_WU_IA) {
+    _motionEvents |= IMU_MOTION_IMPACT;
+    _lastImpactAxes = src & LSM6DSOX_WAKE_UP_SRC_AXES;
+  }
+  if (src & LSM6DSOX_WAKE_UP_SRC_FF_IA) {
+    _motionEvents |= IMU_MOTION_FREEFALL;
+  }
+
+  if (_tiltThresholdDeg == 0) return;
+
+  // Angle between the Z axis and gravity. The board sits flat when upright
+  float mag = sqrtf(accelG[0] * accelG[0] + accelG[1] * accelG[1] + accelG[2] * accelG[2]);
+  if (mag < 0.5f) return; // Not enough gravity to tell (e.g. falling)
+  float tiltDeg = _radToDeg(acosf(constrain(accelG[2] / mag, -1.0f, 1.0f)));
+
+  if (!_tilted && tiltDeg > _tiltThresholdDeg) {
+    if (++_tiltSampleCount >= IMU_MOTION_TILT_SAMPLES) {
+      _tilted = true;
+      _motionEvents |= IMU_MOTION_TILT;
+    }
+  }
+  else if (_tilted && tiltDeg < _tiltThresholdDeg - IMU_MOTION_TILT_HYSTERESIS_DEG) {
+    _tilted = false;
+    _tiltSampleCount = 0;
+  }
+  else if (!_tilted) {
+    _tiltSampleCount = 0;
+  }
+}
+
+uint8_t imuTakeMotionEvents() {
+  uint8_t events = _motionEvents;
+  _motionEvents = 0;
+  return events;
+}
+
+uint8_t imuLastImpactAxes() {
+  return _lastImpactAxes;
+}
+
+struct ImuOdrEntry {
+  int hz;
+  lsm6ds_data_rate_t rate;
+};
+
+const ImuOdrEntry _imuOdrTable[] = {
+  {13, LSM6DS_RATE_12_5_HZ},
+  {26, LSM6DS_RATE_26_HZ},
+  {52, LSM6DS_RATE_52_HZ},
+  {104, LSM6DS_RATE_104_HZ},
+  {208, LSM6DS_RATE_208_HZ},
+  {416, LSM6DS_RATE_416_HZ},
+  {833, LSM6DS_RATE_833_HZ},
+  {1666, LSM6DS_RATE_1_66K_HZ},
+  {3333, LSM6DS_RATE_3_33K_HZ},
+  {6666, LSM6DS_RATE_6_66K_HZ}
+};
+const int _imuNumOdrs = sizeof(_imuOdrTable) / sizeof(_imuOdrTable[0]);
+
+void imuConfigureSensor(uint16_t odrHz, uint8_t accelRangeG, uint16_t gyroRangeDps, uint8_t filters) {
+  if (!_imuReady) return;
+
+  if (odrHz != 0) {
+    int idx = 0;
+    while (idx < _imuNumOdrs - 1 && _imuOdrTable[idx].hz < odrHz) idx++;
+    _lsm6.setAccelDataRate(_imuOdrTable[idx].rate);
+    _lsm6.setGyroDataRate(_imuOdrTable[idx].rate);
+    _imuOdrHz = _imuOdrTable[idx].hz;
+
+    // Keep the default filter rate unless the data rate goes up. Then fuse
+    // proportionally faster, within what the loop can afford. Never faster
+    // than new data shows up
+    int filterRateHz = IMU_MADGWICK_LOOP_FREQ_HZ * _imuOdrHz / IMU_DEFAULT_ODR_HZ;
+    if (filterRateHz < IMU_MADGWICK_LOOP_FREQ_HZ) filterRateHz = IMU_MADGWICK_LOOP_FREQ_HZ;
+    if (filterRateHz > IMU_MAX_FILTER_RATE_HZ) filterRateHz = IMU_MAX_FILTER_RATE_HZ;
+    if (filterRateHz > _imuOdrHz) filterRateHz = _imuOdrHz;
+    imuSetFilterRate(filterRateHz);
+  }
+
+  if (accelRangeG != 0) {
+    if (accelRangeG <= 2) _lsm6.setAccelRange(LSM6DS_ACCEL_RANGE_2_G);
+    else if (accelRangeG <= 4) _lsm6.setAccelRange(LSM6DS_ACCEL_RANGE_4_G);
+    else if (accelRangeG <= 8) _lsm6.setAccelRange(LSM6DS_ACCEL_RANGE_8_G);
+    else _lsm6.setAccelRange(LSM6DS_ACCEL_RANGE_16_G);
+  }
+
+  if (gyroRangeDps != 0) {
+    if (gyroRangeDps <= 125) _lsm6.setGyroRange(LSM6DS_GYRO_RANGE_125_DPS);
+    else if (gyroRangeDps <= 250) _lsm6.setGyroRange(LSM6DS_GYRO_RANGE_250_DPS);
+    else if (gyroRangeDps <= 500) _lsm6.setGyroRange(LSM6DS_GYRO_RANGE_500_DPS);
+    else if (gyroRangeDps <= 1000) _lsm6.setGyroRange(LSM6DS_GYRO_RANGE_1000_DPS);
+    else _lsm6.setGyroRange(LSM6DS_GYRO_RANGE_2000_DPS);
+  }
+
+  // Filters are always written, so 0 turns them off
+  uint8_t ctrl1 = _imuReadReg(LSM6DSOX_REG_CTRL1_XL);
+  if (filters & IMU_FILTER_ACCEL_LPF2) ctrl1 |= LSM6DSOX_CTRL1_XL_LPF2_XL_EN;
+  else ctrl1 &= ~LSM6DSOX_CTRL1_XL_LPF2_XL_EN;
+  _imuWriteReg(LSM6DSOX_REG_CTRL1_XL, ctrl1);
+
+  uint8_t ctrl4 = _imuReadReg(LSM6DSOX_REG_CTRL4_C);
+  if (filters & IMU_FILTER_GYRO_LPF1) ctrl4 |= LSM6DSOX_CTRL4_C_LPF1_SEL_G;
+  else ctrl4 &= ~LSM6DSOX_CTRL4_C_LPF1_SEL_G;
+  _imuWriteReg(LSM6DSOX_REG_CTRL4_C, ctrl4);
+
+  uint8_t ctrl6 = _imuReadReg(LSM6DSOX_REG_CTRL6_C) & ~LSM6DSOX_CTRL6_C_FTYPE_MASK;
+  ctrl6 |= (filters >> IMU_FILTER_GYRO_LPF1_BW_SHIFT) & LSM6DSOX_CTRL6_C_FTYPE_MASK;
+  _imuWriteReg(LSM6DSOX_REG_CTRL6_C, ctrl6);
+
+  // Motion thresholds are in units of the range and sample rate
+  if (_motionImpactMg != 0 || _motionFreeFallMs != 0 || _tiltThresholdDeg != 0) {
+    imuConfigureMotionEvents(_motionImpactMg, _tiltThresholdDeg, _motionFreeFallMs);
+  }
+
+  Serial.printf("[IMU] ODR %d Hz, accel +-%dG, gyro %d DPS, filters 0x%02x\n",
+      _imuOdrHz, imuGetAccelRangeG(), imuGetGyroRangeDps(), filters);
+}
+
+int imuGetOdrHz() {
+  return _imuOdrHz;
+}
+
+int imuGetAccelRangeG() {
+  switch (_lsm6.getAccelRange()) {
+    case LSM6DS_ACCEL_RANGE_2_G: return 2;
+    case LSM6DS_ACCEL_RANGE_4_G: return 4;
+    case LSM6DS_ACCEL_RANGE_8_G: return 8;
+    case LSM6DS_ACCEL_RANGE_16_G: return 16;
+  }
+  return 0;
+}
+
+int imuGetGyroRangeDps() {
+  switch (_lsm6.getGyroRange()) {
+    case LSM6DS_GYRO_RANGE_125_DPS: return 125;
+    case LSM6DS_GYRO_RANGE_250_DPS: return 250;
+    case LSM6DS_GYRO_RANGE_500_DPS: return 500;
+    case LSM6DS_GYRO_RANGE_1000_DPS: return 1000;
+    case LSM6DS_GYRO_RANGE_2000_DPS: return 2000;
+    default: return 0;
+  }
+}
+
+void imuSetMotionCutoff(uint8_t eventMask) {
+  _motionCutoffMask = eventMask;
+}
+
+uint8_t imuMotionCutoffMask() {
+  return _motionCutoffMask;
+}
+
+bool _ahrsAccelIsGravity(float accelG[3]) {
+  float mag = sqrtf(accelG[0] * accelG[0] + accelG[1] * accelG[1] + accelG[2] * accelG[2]);
+  return fabsf(mag - 1.0f) < IMU_AHRS_STATIC_TOLERANCE_G;
+}
+
+// Correction only (no rotation), pulling the filter towards the accel vector
+void _ahrsCorrect(float accelG[3], int steps) {
+  for (int i = 0; i < steps; i++) {
+    _ahrsFilter.updateIMU(0, 0, 0, accelG[0], accelG[1], accelG[2]);
+  }
+}
+
+/**
+ * Compare the filter's roll/pitch with what the accelerometer says, and
+ * speed the filter up while they disagree
+ */
+void _ahrsConvergenceUpdate(float accelG[3]) {
+  if (!_ahrsAccelIsGravity(accelG)) {
+    // Robot is accelerating, so the accel isn't a usable reference
+    _ahrsSettleCount = 0;
+    return;
+  }
+
+  if (!_ahrsConverged) {
+    int substeps = IMU_AHRS_FAST_STEPS_PER_SEC / _filterRateHz;
+    if (substeps > IMU_AHRS_FAST_SUBSTEPS) substeps = IMU_AHRS_FAST_SUBSTEPS;
+    if (substeps < 1) substeps = 1;
+    _ahrsCorrect(accelG, substeps);
+  }
+
+  float mag = sqrtf(accelG[0] * accelG[0] + accelG[1] * accelG[1] + accelG[2] * accelG[2]);
+  float accelRoll = _radToDeg(atan2f(accelG[1], accelG[2]));
+  float accelPitch = _radToDeg(asinf(constrain(-accelG[0] / mag, -1.0f, 1.0f)));
+
+  float rollErr = fabsf(_ahrsFilter.getRoll() - accelRoll);
+  if (rollErr > 180.0f) rollErr = 360.0f - rollErr;
+  float pitchErr = fabsf(_ahrsFilter.getPitch() - accelPitch);
+  float err = rollErr > pitchErr ? rollErr : pitchErr;
+
+  bool settling = _ahrsConverged ? err > IMU_AHRS_DIVERGED_DEG : err < IMU_AHRS_CONVERGED_DEG;
+  if (!settling) {
+    _ahrsSettleCount = 0;
+    return;
+  }
+
+  if (++_ahrsSettleCount >= IMU_AHRS_SETTLE_SAMPLES) {
+    _ahrsConverged = !_ahrsConverged;
+    _ahrsSettleCount = 0;
+    Serial.printf("[IMU] AHRS %s (error %.1f deg)\n", _ahrsConverged ? "converged" : "diverged, speeding up", err);
+  }
+}
+
+bool imuAhrsConverged() {
+  return _ahrsConverged;
+}
+
 unsigned long _imuLoopTime = 0;
 int _imuLoopCount = 0;
 
-void imuPeriodic() {
+/**
+ * Run the AHRS filter if an update is due
+ *
+ * @return true if the filter was updated
+ */
+bool imuPeriodic() {
+  // Nothing to read, and no bus to read motion events from
+  if (!_imuReady) return false;
+
   // Initialize the filter if this is the first time we are running through the periodic
   if (!_filterStarted) {
-    Serial.printf("[IMU] Starting Madgwick filter at %u hz\n", IMU_MADGWICK_LOOP_FREQ_HZ);
-    _microsPerReading = 1000000 / IMU_MADGWICK_LOOP_FREQ_HZ;
+    Serial.printf("[IMU] Starting Madgwick filter at %u hz\n", _filterRateHz);
+    _microsPerReading = 1000000 / _filterRateHz;
     _microsPrevious = micros();
-    _ahrsFilter.begin(IMU_MADGWICK_LOOP_FREQ_HZ);
+    _ahrsFilter.begin(_filterRateHz);
     _filterStarted = true;
-    return;
+
+    // Start from the orientation measured during calibration, not level
+    _ahrsCorrect(_ahrsSeedAccelG, IMU_AHRS_SEED_ITERATIONS);
+    return false;
   }
 
   unsigned long microsNow = micros();
@@ -211,16 +883,34 @@ void imuPeriodic() {
 
     _lsm6.getEvent(&accel, &gyro, &temp);
 
-    _gyroRatesDPS[0] = _radToDeg(gyro.gyro.x) - _gyroOffsetsDPS[0];
-    _gyroRatesDPS[1] = _radToDeg(gyro.gyro.y) - _gyroOffsetsDPS[1];
-    _gyroRatesDPS[2] = _radToDeg(gyro.gyro.z) - _gyroOffsetsDPS[2];
+    float rawGyroDPS[3] = {
+      _radToDeg(gyro.gyro.x),
+      _radToDeg(gyro.gyro.y),
+      _radToDeg(gyro.gyro.z)
+    };
+
+    float rawAccelG[3] = {
+      _accelToG(accel.acceleration.x),
+      _accelToG(accel.acceleration.y),
+      _accelToG(accel.acceleration.z)
+    };
 
-    _accelG[0] = _accelToG(accel.acceleration.x) - _accelOffsetsG[0];
-    _accelG[1] = _accelToG(accel.acceleration.y) - _accelOffsetsG[1];
-    _accelG[2] = _accelToG(accel.acceleration.z) - _accelOffsetsG[2];
+    _imuTempC = temp.temperature;
+
+    _imuCalibrationUpdate(rawGyroDPS, rawAccelG);
+    _gyroBiasUpdate(rawGyroDPS, rawAccelG);
+    _gyroBiasApplyModel();
+
+    for (int i = 0; i < 3; i++) {
+      _gyroRatesDPS[i] = rawGyroDPS[i] - _gyroOffsetsDPS[i];
+      _accelG[i] = rawAccelG[i] - _accelOffsetsG[i];
+    }
+
+    _imuMotionUpdate(rawAccelG);
 
     // Update the filter, which will compute orientation
     _ahrsFilter.updateIMU(_gyroRatesDPS[0], _gyroRatesDPS[1], _gyroRatesDPS[2], _accelG[0], _accelG[1], _accelG[2]);
+    _ahrsConvergenceUpdate(_accelG);
 
     // Increment the previous time so that we keep proper pace
     _microsPrevious = _microsPrevious + _microsPerReading;
@@ -234,7 +924,32 @@ void imuPeriodic() {
       _imuLoopCount = 0;
       _imuLoopTime = 0;
     }
+
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * Change the AHRS filter update rate.
+ *
+ * The filter keeps its current orientation; only the sample period changes
+ */
+void imuSetFilterRate(int rateHz) {
+  if (rateHz <= 0 || rateHz == _filterRateHz) return;
+
+  _filterRateHz = rateHz;
+  if (_filterStarted) {
+    _microsPerReading = 1000000 / _filterRateHz;
+    _microsPrevious = micros();
+    _ahrsFilter.begin(_filterRateHz);
   }
+  Serial.printf("[IMU] Madgwick filter rate set to %d hz\n", _filterRateHz);
+}
+
+int imuGetFilterRate() {
+  return _filterRateHz;
 }
 
 /**
@@ -406,6 +1121,21 @@ void imuResetYaw() {
   _ahrsOffsets[2] = _ahrsFilter.getYaw();
 }
 
+/**
+ * Reset a set of axes (IMU_AXIS_* bitmask)
+ */
+void imuResetAxes(uint8_t axisMask) {
+  if (axisMask & IMU_AXIS_ROLL) {
+    imuResetRoll();
+  }
+  if (axisMask & IMU_AXIS_PITCH) {
+    imuResetPitch();
+  }
+  if (axisMask & IMU_AXIS_YAW) {
+    imuResetYaw();
+  }
+}
+
 void gyroReset() {
   Serial.println("[IMU] Resetting Gyro");
   imuResetRoll();
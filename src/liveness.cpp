@@ -0,0 +1,122 @@
+#include "liveness.h"
+#include "events.h"
+#include "robot.h"
+
+#include <Arduino.h>
+
+namespace xrp {
+
+// Written by the core that owns the index, read by the other one
+volatile unsigned long _lastBeatMs[2] = {0, 0};
+volatile bool _coreStalled[2] = {false, false};
+volatile unsigned long _stallCount[2] = {0, 0};
+
+// Set by core 1 when it stops the motors, reported by core 0 once it's back
+volatile bool _core0StallPending = false;
+volatile unsigned long _core0StallAgeMs = 0;
+
+unsigned long _core1StallStart = 0;
+
+// Set around flash writes by core 0, read by both checkers
+volatile int _livenessPauseDepth = 0;
+volatile unsigned long _livenessResumeMs = 0;
+
+void livenessBeat() {
+  _lastBeatMs[get_core_num()] = millis();
+}
+
+void livenessPause() {
+  _livenessPauseDepth++;
+}
+
+void livenessResume() {
+  if (_livenessPauseDepth == 0) return;
+  _livenessResumeMs = millis();
+  _livenessPauseDepth--;
+}
+
+// Time since a core last beat, not counting anything before the last pause ended
+unsigned long _beatAge(int core, unsigned long now) {
+  unsigned long since = _lastBeatMs[core];
+  if ((long)(_livenessResumeMs - since) > 0) {
+    since = _livenessResumeMs;
+  }
+  return now - since;
+}
+
+void livenessCheckCore1() {
+  unsigned long now = millis();
+
+  // Report a core 0 stall that core 1 caught
+  if (_core0StallPending) {
+    _core0StallPending = false;
+
+    // Zero the motors properly, then hand the pins back to PWM
+    robotStopMotors();
+    robotRestoreMotorOutputs();
+    Serial.printf("[LIVE] Core 0 was stalled (%lu ms). Motors were stopped\n", _core0StallAgeMs);
+    eventsPost(XRP_EVENT_CORE_STALL, 0);
+  }
+
+  // Nothing to watch until core 1 is up
+  if (_lastBeatMs[1] == 0) return;
+  if (_livenessPauseDepth > 0) return;
+
+  unsigned long age = _beatAge(1, now);
+  if (age <= XRP_CORE1_STALL_MS) {
+    if (_coreStalled[1]) {
+      Serial.println("[LIVE] Core 1 recovered");
+    }
+    _coreStalled[1] = false;
+    return;
+  }
+
+  if (!_coreStalled[1]) {
+    _coreStalled[1] = true;
+    _stallCount[1]++;
+    _core1StallStart = now;
+    Serial.printf("[LIVE] Core 1 stalled (%lu ms). Marking its data stale\n", age);
+    eventsPost(XRP_EVENT_CORE_STALL, 1);
+  }
+
+  if (now - _core1StallStart > XRP_CORE1_RESTART_MS) {
+    Serial.println("[LIVE] Restarting core 1");
+    _lastBeatMs[1] = millis();
+    _core1StallStart = millis();
+    rp2040.restartCore1();
+  }
+}
+
+void livenessCheckCore0() {
+  unsigned long now = millis();
+  // Core 0 doesn't beat until setup() is done
+  if (_lastBeatMs[0] == 0) return;
+  if (_livenessPauseDepth > 0) return;
+
+  unsigned long age = _beatAge(0, now);
+  if (age <= XRP_CORE0_STALL_MS) {
+    _coreStalled[0] = false;
+    return;
+  }
+
+  if (!_coreStalled[0]) {
+    _coreStalled[0] = true;
+    _stallCount[0]++;
+
+    // Core 0 owns the outputs and their state, but it isn't around to stop
+    // them. Cut the drive pins without touching either
+    robotCutMotorOutputs();
+    _core0StallAgeMs = age;
+    _core0StallPending = true;
+  }
+}
+
+bool livenessCoreStalled(int core) {
+  return _coreStalled[core];
+}
+
+unsigned long livenessStallCount(int core) {
+  return _stallCount[core];
+}
+
+} // namespace xrp
@@ -11,8 +11,21 @@
 
 #include "byteutils.h"
 #include "config.h"
+#include "cpuload.h"
+#include "crashlog.h"
+#include "discovery.h"
+#include "events.h"
+#include "group.h"
 #include "imu.h"
+#include "liveness.h"
+#include "memstats.h"
+#include "ota.h"
+#include "overload.h"
 #include "robot.h"
+#include "sysid.h"
+#include "telemetrysync.h"
+#include "udpguard.h"
+#include "watchdog.h"
 #include "wpilibudp.h"
 
 // Resource strings
@@ -47,10 +60,32 @@ unsigned long _lastMessageStatusPrint = 0;
 int _baselineUsedHeap = 0;
 
 unsigned long _avgLoopTimeUs = 0;
+unsigned long _maxLoopTimeUs = 0;
 unsigned long _loopTimeMeasurementCount = 0;
 
 uint16_t seq = 0;
 
+// Last time the web server was serviced (used when shedding load)
+unsigned long _lastWebServiceTime = 0;
+
+// Last CPU load window sent upstream
+unsigned long _lastCpuLoadWindowSent = 0;
+
+// Firmware version (major, minor, patch) advertised in the capabilities tag
+uint8_t fwVersion[3] = {0, 0, 0};
+
+// Used to catch the DS watchdog tripping
+bool _dsWatchdogWasActive = false;
+bool _robotWasEnabled = false;
+
+// Last time a packet from the unicast host was processed. Group packets feed
+// the DS watchdog too, so that alone can't tell us who is in control
+unsigned long _lastUnicastPacketTime = 0;
+
+// Result of the last firmware upload, reported once the upload is done
+bool _otaUploadOk = false;
+bool _otaUploadRejected = false;
+
 // Generate the status text file
 void writeStatusToDisk() {
   File f = LittleFS.open("/status.txt", "w");
@@ -68,6 +103,13 @@ void writeStatusToDisk() {
   }
 
   f.printf("IP Address: %s\n", WiFi.localIP().toString().c_str());
+  f.printf("Last Reset: %s\n", xrp::crashlogResetReasonString());
+  if (xrp::otaState() != xrp::OTA_STATE_NONE) {
+    f.printf("Firmware Update: %s\n", xrp::otaStateString());
+  }
+  f.printf("IMU: %s\n", xrp::imuIsReady() ? "Detected" : "Not detected");
+  f.printf("Reflectance: %s\n", xrp::reflectanceInitialized() ? "Detected" : "Not detected");
+  f.printf("Rangefinder: %s\n", xrp::rangefinderInitialized() ? "Detected" : "Not detected");
   f.close();
 }
 
@@ -99,6 +141,123 @@ void updateRemoteInfo() {
   }
 }
 
+bool unicastSessionActive() {
+  return udpRemoteAddr.isSet() && millis() - _lastUnicastPacketTime < DEFAULT_WATCHDOG_TIMEOUT;
+}
+
+uint8_t detectedSensors() {
+  uint8_t sensors = 0;
+  if (xrp::imuIsReady()) sensors |= XRP_CAP_SENSOR_IMU;
+  if (xrp::reflectanceInitialized()) sensors |= XRP_CAP_SENSOR_REFLECTANCE;
+  if (xrp::rangefinderInitialized()) sensors |= XRP_CAP_SENSOR_RANGEFINDER;
+  return sensors;
+}
+
+// Tell a host looking for robots who we are and whether we're taken
+void sendDiscoveryReply() {
+  StaticJsonDocument<256> reply;
+  char version[12];
+  snprintf(version, sizeof(version), "%d.%d.%d", fwVersion[0], fwVersion[1], fwVersion[2]);
+
+  reply["chipId"] = chipID;
+  // Strings are copied into the document. A c_str() of a temporary would dangle
+  reply["ip"] = WiFi.localIP().toString();
+  reply["port"] = 3540;
+  reply["version"] = version;
+  reply["protocol"] = XRP_PROTOCOL_EXT_VERSION;
+  reply["sensors"] = detectedSensors();
+
+  if (unicastSessionActive()) {
+    reply["owner"] = udpRemoteAddr.toString();
+  }
+  else {
+    reply["owner"] = nullptr;
+  }
+
+  char buffer[256];
+  size_t len = serializeJson(reply, buffer, sizeof(buffer));
+  xrp::discoveryReply(buffer, len);
+}
+
+// Tell the host about motion events, and stop the motors if asked to
+void handleMotionEvents(uint8_t motionEvents) {
+  if (!motionEvents) return;
+
+  if (motionEvents & IMU_MOTION_IMPACT) {
+    xrp::eventsPost(XRP_EVENT_IMPACT, xrp::imuLastImpactAxes());
+  }
+  if (motionEvents & IMU_MOTION_TILT) {
+    xrp::eventsPost(XRP_EVENT_TILT);
+  }
+  if (motionEvents & IMU_MOTION_FREEFALL) {
+    xrp::eventsPost(XRP_EVENT_FREEFALL);
+  }
+
+  uint8_t cutoff = motionEvents & xrp::imuMotionCutoffMask();
+  if (cutoff) {
+    // Report the most serious one
+    uint8_t cause = (cutoff & IMU_MOTION_FREEFALL) ? XRP_EVENT_FREEFALL :
+                    (cutoff & IMU_MOTION_TILT) ? XRP_EVENT_TILT : XRP_EVENT_IMPACT;
+    xrp::robotSafetyStop(cause);
+  }
+}
+
+// Append every undelivered event. Returns the number of bytes written
+int writeEvents(char* buffer, int ptr) {
+  xrp::XRPEvent events[XRP_EVENT_QUEUE_SIZE];
+  int numEvents = xrp::eventsPending(events, XRP_EVENT_QUEUE_SIZE);
+
+  int written = 0;
+  for (int i = 0; i < numEvents; i++) {
+    written += wpilibudp::writeEventData(events[i].id, events[i].cause, events[i].detail, events[i].timeMs, buffer, ptr + written);
+  }
+  return written;
+}
+
+// Only hosts that sent a Hello know what to do with events
+bool eventsWanted() {
+  return udpRemoteAddr.isSet() && wpilibudp::negotiatedProtocolVersion() >= 1;
+}
+
+// Out of cycle frame with just the events, so the host hears about them now
+void sendEvents() {
+  if (!eventsWanted()) return;
+
+  char buffer[128];
+  uint16ToNetwork(seq, buffer);
+  buffer[2] = 0;
+  int size = 3 + writeEvents(buffer, 3);
+
+  udp.beginPacket(udpRemoteAddr.toString().c_str(), udpRemotePort);
+  udp.write(buffer, size);
+  udp.endPacket();
+  seq++;
+
+  xrp::eventsMarkSent();
+}
+
+void sendSysIdData() {
+  if (!udpRemoteAddr.isSet()) return;
+
+  char buffer[1024];
+  uint16ToNetwork(seq, buffer);
+  buffer[2] = 0;
+  int ptr = 3;
+
+  xrp::SysIdSample samples[XRP_SYSID_SAMPLES_PER_TAG];
+  for (int i = 0; i < XRP_SYSID_TAGS_PER_PACKET; i++) {
+    uint16_t firstIndex;
+    int count = xrp::sysidNextChunk(samples, XRP_SYSID_SAMPLES_PER_TAG, &firstIndex);
+    if (count == 0) break;
+    ptr += wpilibudp::writeSysIdData(firstIndex, samples, count, buffer, ptr);
+  } // 4x 229 bytes
+
+  udp.beginPacket(udpRemoteAddr.toString().c_str(), udpRemotePort);
+  udp.write(buffer, ptr);
+  udp.endPacket();
+  seq++;
+}
+
 void sendData() {
   int size = 0;
   char buffer[512];
@@ -109,17 +268,28 @@ void sendData() {
   ptr = 3;
 
   // Encoders
-  for (int i = 0; i < 4; i++) {
-    int encoderValue = xrp::readEncoderRaw(i);
-
-    // We want to flip the encoder 0 value (left motor encoder) so that this returns
-    // positive values when moving forward.
-    if (i == 0) {
-      encoderValue = -encoderValue;
+  if (xrp::encodersConfigured()) {
+    // Only send the encoders that the host asked for
+    for (auto encData : xrp::getActiveEncoderValues()) {
+      ptr += wpilibudp::writeEncoderData(encData.first, encData.second, buffer, ptr);
     }
-
-    ptr += wpilibudp::writeEncoderData(i, encoderValue, buffer, ptr);
-  } // 4x 7 bytes
+  }
+  else {
+    // Hosts that don't configure encoders get all four, indexed natively
+    for (int i = 0; i < 4; i++) {
+      int64_t encoderValue = xrp::readEncoderRaw(i);
+
+      // We want to flip the encoder 0 value (left motor encoder) so that this returns
+      // positive values when moving forward.
+      if (i == 0) {
+        encoderValue = -encoderValue;
+      }
+
+      // The wire format is 32-bit, so the host sees the low 32 bits of the
+      // accumulated count and handles wrapping on its end
+      ptr += wpilibudp::writeEncoderData(i, (int32_t)encoderValue, buffer, ptr);
+    }
+  } // up to 4x 7 bytes
 
   // DIO (currently just the button)
   ptr += wpilibudp::writeDIOData(0, xrp::isUserButtonPressed(), buffer, ptr);
@@ -149,15 +319,80 @@ void sendData() {
   ptr += wpilibudp::writeAccelData(accels, buffer, ptr);
   // 1x 14 bytes
 
+  // Optional extension tags are the first thing to go when we're overloaded
+  bool sendExtras = !xrp::overloadShedding(XRP_OVERLOAD_LEVEL_TELEMETRY);
+
+  if (sendExtras && xrp::telemetrySyncLead() != 0 && wpilibudp::negotiatedProtocolVersion() >= 1) {
+    ptr += wpilibudp::writeTelemetrySyncData(xrp::telemetrySyncLocked(), xrp::telemetrySyncPeriodUs(), xrp::telemetrySyncPhaseErrorUs(), buffer, ptr);
+  } // 1x 11 bytes
+
+  // Hosts that speak the extensions get the AHRS state
+  if (sendExtras && xrp::imuIsReady() && wpilibudp::negotiatedProtocolVersion() >= 1) {
+    uint8_t imuFlags = 0;
+    if (xrp::imuAhrsConverged()) imuFlags |= XRP_IMU_STATUS_AHRS_CONVERGED;
+    if (xrp::imuBiasModelValid()) imuFlags |= XRP_IMU_STATUS_BIAS_MODEL;
+    ptr += wpilibudp::writeImuStatusData(imuFlags, xrp::imuGetTemperatureC(), buffer, ptr);
+  } // 1x 7 bytes
+
+  // Only report calibration status while there is something to report
+  if (xrp::imuGetCalibrationState() != xrp::IMU_CAL_IDLE) {
+    ptr += wpilibudp::writeGyroCalStatusData(xrp::imuGetCalibrationState(), xrp::imuGetCalibrationProgress(), buffer, ptr);
+  } // 1x 4 bytes
+
   if (xrp::reflectanceInitialized()) {
     ptr += wpilibudp::writeAnalogData(0, xrp::getReflectanceLeft5V(), buffer, ptr);
     ptr += wpilibudp::writeAnalogData(1, xrp::getReflectanceRight5V(), buffer, ptr);
   }
 
-  if (xrp::rangefinderInitialized()) {
+  // Don't pass along a stale distance if core 1 is stuck
+  if (xrp::rangefinderInitialized() && !xrp::livenessCoreStalled(1)) {
     ptr += wpilibudp::writeAnalogData(2, xrp::getRangefinderDistance5V(), buffer, ptr);
   }
 
+  // Hosts that speak the extensions also get the distance in metres
+  if (sendExtras && xrp::rangefinderInitialized() && wpilibudp::negotiatedProtocolVersion() >= 1) {
+    bool valid = xrp::rangefinderValid() && !xrp::livenessCoreStalled(1);
+    ptr += wpilibudp::writeDistanceData(xrp::getRangefinderDistanceMetres(), valid,
+        (uint8_t)xrp::rangefinderSampleRateHz(), buffer, ptr);
+  } // 1x 8 bytes
+
+  // CPU load, once per window, if the host asked for it
+  if (sendExtras && (wpilibudp::telemetryOptions() & XRP_TELEMETRY_OPT_CPU_LOAD) &&
+      xrp::cpuloadWindowCount() != _lastCpuLoadWindowSent) {
+    ptr += wpilibudp::writeCpuLoadData(
+        xrp::cpuloadUtilization(0), xrp::cpuloadUtilizationLong(0),
+        xrp::cpuloadUtilization(1), xrp::cpuloadUtilizationLong(1),
+        buffer, ptr);
+    _lastCpuLoadWindowSent = xrp::cpuloadWindowCount();
+  } // 1x 6 bytes
+
+  if (sendExtras && xrp::sysidState() != xrp::SYSID_IDLE && wpilibudp::negotiatedProtocolVersion() >= 1) {
+    ptr += wpilibudp::writeSysIdStatusData(xrp::sysidState(), xrp::sysidSampleCount(), xrp::sysidSamplePeriodUs(),
+        xrp::sysidOverrunCount(), buffer, ptr);
+  } // 1x 13 bytes
+
+  // What the motors and servos are really doing, if the host asked
+  if (sendExtras && (wpilibudp::telemetryOptions() & XRP_TELEMETRY_OPT_ACTUATOR_STATE)) {
+    float outputs[XRP_NUM_PWM_CHANNELS];
+    uint8_t reasons[XRP_NUM_PWM_CHANNELS];
+    for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+      outputs[ch] = xrp::actuatorOutput(ch);
+      reasons[ch] = xrp::actuatorOverrideReason(ch);
+    }
+    ptr += wpilibudp::writeActuatorStateData(outputs, reasons, XRP_NUM_PWM_CHANNELS, buffer, ptr);
+  } // 1x 20 bytes
+
+  // Answer a host hello in the next frame
+  if (wpilibudp::capabilitiesRequested()) {
+    ptr += wpilibudp::writeCapabilitiesData(fwVersion, 1000000 / XRP_TELEMETRY_SYNC_MIN_SEND_PERIOD_US, detectedSensors(), buffer, ptr);
+    wpilibudp::clearCapabilitiesRequest();
+  }
+
+  // Events ride along until a periodic frame has carried them
+  if (eventsWanted()) {
+    ptr += writeEvents(buffer, ptr);
+  } // up to 8x 10 bytes
+
   // ptr should now point to 1 past the last byte
   size = ptr;
 
@@ -167,6 +402,9 @@ void sendData() {
     udp.write(buffer, size);
     udp.endPacket();
     seq++;
+
+    // A legacy host never gets the events, so there's no point holding on to them
+    xrp::eventsMarkDelivered();
   }
 }
 
@@ -194,6 +432,152 @@ void setupWebServerRoutes() {
     webServer.send(200, "text/javascript", GetResource_xrp_js(&len), len);
   });
 
+  webServer.on("/metrics", []() {
+    std::string metrics;
+    char line[96];
+    for (int core = 0; core < 2; core++) {
+      snprintf(line, sizeof(line), "xrp_cpu_utilization_percent{core=\"%d\",window=\"1s\"} %.1f\n", core, xrp::cpuloadUtilization(core));
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_cpu_utilization_percent{core=\"%d\",window=\"10s\"} %.1f\n", core, xrp::cpuloadUtilizationLong(core));
+      metrics += line;
+      for (int task = 0; task < XRP_CPU_NUM_TASKS; task++) {
+        unsigned long taskUs = xrp::cpuloadTaskTimeUs(core, task);
+        if (taskUs == 0) continue;
+        snprintf(line, sizeof(line), "xrp_cpu_task_time_us{core=\"%d\",task=\"%s\"} %lu\n", core, xrp::cpuloadTaskName(task), taskUs);
+        metrics += line;
+        snprintf(line, sizeof(line), "xrp_cpu_task_max_us{core=\"%d\",task=\"%s\"} %lu\n", core, xrp::cpuloadTaskName(task), xrp::cpuloadTaskMaxUs(core, task));
+        metrics += line;
+      }
+    }
+    for (int core = 0; core < 2; core++) {
+      snprintf(line, sizeof(line), "xrp_core_stalls_total{core=\"%d\"} %lu\n", core, xrp::livenessStallCount(core));
+      metrics += line;
+    }
+    for (int core = 0; core < 2; core++) {
+      if (xrp::memstatsStackSize(core) < 0) continue;
+      snprintf(line, sizeof(line), "xrp_stack_size_bytes{core=\"%d\"} %d\n", core, xrp::memstatsStackSize(core));
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_stack_high_water_bytes{core=\"%d\"} %d\n", core, xrp::memstatsStackHighWater(core));
+      metrics += line;
+    }
+    snprintf(line, sizeof(line), "xrp_heap_total_bytes %u\n", xrp::memstatsHeapTotal());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_heap_used_bytes %u\n", xrp::memstatsHeapUsed());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_heap_peak_bytes %u\n", xrp::memstatsHeapPeak());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_heap_top_free_bytes %u\n", xrp::memstatsHeapTopFree());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_loop_time_p%d_us %lu\n", XRP_OVERLOAD_PERCENTILE, xrp::overloadLoopTimePercentileUs());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_overload_level %u\n", xrp::overloadLevel());
+    metrics += line;
+    for (int level = 0; level < XRP_OVERLOAD_NUM_LEVELS; level++) {
+      snprintf(line, sizeof(line), "xrp_overload_time_ms{level=\"%s\"} %lu\n", xrp::overloadLevelName(level), xrp::overloadTimeAtLevelMs(level));
+      metrics += line;
+    }
+    snprintf(line, sizeof(line), "xrp_udp_packets_total{result=\"accepted\"} %lu\n", xrp::udpGuardAcceptedCount());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_udp_packets_total{result=\"not_owner\"} %lu\n", xrp::udpGuardNotOwnerCount());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_udp_packets_total{result=\"rate_limited\"} %lu\n", xrp::udpGuardRateLimitedCount());
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_telemetry_sync_locked %d\n", xrp::telemetrySyncLocked() ? 1 : 0);
+    metrics += line;
+    if (xrp::telemetrySyncLocked()) {
+      snprintf(line, sizeof(line), "xrp_host_period_us %lu\n", xrp::telemetrySyncPeriodUs());
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_telemetry_phase_error_us %ld\n", (long)xrp::telemetrySyncPhaseErrorUs());
+      metrics += line;
+    }
+    if (xrp::imuIsReady()) {
+      snprintf(line, sizeof(line), "xrp_imu_temperature_c %.1f\n", xrp::imuGetTemperatureC());
+      metrics += line;
+    }
+    if (xrp::rangefinderInitialized()) {
+      snprintf(line, sizeof(line), "xrp_rangefinder_rate_hz %.1f\n", xrp::rangefinderSampleRateHz());
+      metrics += line;
+    }
+    if (xrp::groupEnabled()) {
+      snprintf(line, sizeof(line), "xrp_group_packets_total %lu\n", xrp::groupPacketCount());
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_group_commands_total{result=\"applied\"} %lu\n", xrp::groupCommandsApplied());
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_group_commands_total{result=\"late\"} %lu\n", xrp::groupCommandsLate());
+      metrics += line;
+      snprintf(line, sizeof(line), "xrp_group_clock_offset_ms %ld\n", (long)xrp::groupClockOffsetMs());
+      metrics += line;
+    }
+    snprintf(line, sizeof(line), "xrp_loop_time_avg_us %lu\n", _avgLoopTimeUs);
+    metrics += line;
+    snprintf(line, sizeof(line), "xrp_loop_time_max_us %lu\n", _maxLoopTimeUs);
+    metrics += line;
+    webServer.send(200, "text/plain", metrics.c_str());
+  });
+
+  webServer.on("/update", HTTP_GET, []() {
+    webServer.send(200, "text/plain", xrp::otaStateString());
+  });
+
+  webServer.on("/update", HTTP_POST, []() {
+    if (_otaUploadRejected) {
+      webServer.send(409, "text/plain", "Robot is enabled");
+    }
+    else if (!_otaUploadOk) {
+      webServer.send(400, "text/plain", xrp::otaLastError());
+    }
+    else {
+      webServer.send(200, "text/plain", "OK");
+    }
+  }, []() {
+    HTTPUpload& upload = webServer.upload();
+
+    // The whole upload is handled inside a single handleClient() call. Every
+    // step below writes flash, so liveness checks are paused across each one
+    rp2040.wdt_reset();
+    xrp::livenessBeat();
+
+    if (upload.status == UPLOAD_FILE_START) {
+      _otaUploadOk = false;
+      _otaUploadRejected = xrp::robotEnabled();
+      if (_otaUploadRejected) {
+        Serial.println("[OTA] Refusing firmware upload while the robot is enabled");
+        return;
+      }
+      if (!webServer.hasArg("crc")) {
+        xrp::otaReject("Missing crc");
+        return;
+      }
+      xrp::livenessPause();
+      xrp::otaBegin(strtoul(webServer.arg("crc").c_str(), nullptr, 16),
+          strtoul(webServer.arg("size").c_str(), nullptr, 10));
+      xrp::livenessResume();
+    }
+    else if (upload.status == UPLOAD_FILE_WRITE) {
+      xrp::livenessPause();
+      xrp::otaWrite(upload.buf, upload.currentSize);
+      xrp::livenessResume();
+    }
+    else if (upload.status == UPLOAD_FILE_END) {
+      xrp::livenessPause();
+      _otaUploadOk = xrp::otaEnd();
+      xrp::livenessResume();
+    }
+    else if (upload.status == UPLOAD_FILE_ABORTED) {
+      xrp::otaAbort();
+    }
+  });
+
+  webServer.on("/crashlog", []() {
+    if (!xrp::crashlogAvailable()) {
+      webServer.send(404, "text/plain", "No crash log");
+      return;
+    }
+    File f = LittleFS.open("/crashlog.txt", "r");
+    webServer.streamFile(f, "text/plain");
+    f.close();
+  });
+
   webServer.on("/getconfig", []() {
     File f = LittleFS.open("/config.json", "r");
     if (webServer.streamFile(f, "text/json") != f.size()) {
@@ -207,9 +591,11 @@ void setupWebServerRoutes() {
       webServer.send(405, "text/plain", "Method Not Allowed");
       return;
     }
+    xrp::livenessPause();
     File f = LittleFS.open("/config.json", "w");
     f.print(generateDefaultConfig(DEFAULT_SSID).toJsonString().c_str());
     f.close();
+    xrp::livenessResume();
     webServer.send(200, "text/plain", "OK");
   });
 
@@ -219,9 +605,11 @@ void setupWebServerRoutes() {
       return;
     }
     auto postBody = webServer.arg("plain");
+    xrp::livenessPause();
     File f = LittleFS.open("/config.json", "w");
     f.print(postBody);
     f.close();
+    xrp::livenessResume();
     Serial.println("[CONFIG] Configuration Updated Remotely");
 
     webServer.send(200, "text/plain", "OK");
@@ -232,29 +620,72 @@ void checkPrintStatus() {
   if (millis() - _lastMessageStatusPrint > 5000) {
 
     int usedHeap = rp2040.getUsedHeap();
-    Serial.printf("t(ms):%u h:%d msg:%u lt(us):%u\n", millis(), usedHeap, _wsMessageCount, _avgLoopTimeUs);
+    Serial.printf("t(ms):%u h:%d msg:%u lt(us):%u max(us):%u cpu0:%.0f%%/%.0f%% cpu1:%.0f%%/%.0f%%\n",
+        millis(), usedHeap, _wsMessageCount, _avgLoopTimeUs, _maxLoopTimeUs,
+        xrp::cpuloadUtilization(0), xrp::cpuloadUtilizationLong(0),
+        xrp::cpuloadUtilization(1), xrp::cpuloadUtilizationLong(1));
+    if (xrp::overloadLevel() != XRP_OVERLOAD_LEVEL_NONE) {
+      Serial.printf("[OVERLOAD] Shedding level: %s for %lu ms\n",
+          xrp::overloadLevelName(xrp::overloadLevel()), xrp::overloadLevelDurationMs());
+    }
+    if (xrp::livenessStallCount(0) > 0 || xrp::livenessStallCount(1) > 0) {
+      Serial.printf("[LIVE] Stalls core0:%lu core1:%lu\n", xrp::livenessStallCount(0), xrp::livenessStallCount(1));
+    }
+    Serial.printf("udp ok:%lu notowner:%lu ratelimited:%lu\n",
+        xrp::udpGuardAcceptedCount(), xrp::udpGuardNotOwnerCount(), xrp::udpGuardRateLimitedCount());
+    Serial.printf("heap used:%u peak:%u topfree:%u total:%u stack0:%d/%d stack1:%d/%d\n",
+        xrp::memstatsHeapUsed(), xrp::memstatsHeapPeak(), xrp::memstatsHeapTopFree(), xrp::memstatsHeapTotal(),
+        xrp::memstatsStackHighWater(0), xrp::memstatsStackSize(0),
+        xrp::memstatsStackHighWater(1), xrp::memstatsStackSize(1));
     _lastMessageStatusPrint = millis();
   }
 }
 
+// Mark progress through loop() for the crash log and the core 1 supervisor
+void markSpan(uint8_t spanId) {
+  xrp::crashlogMark(spanId);
+  xrp::livenessBeat();
+}
+
 void updateLoopTime(unsigned long loopStart) {
   unsigned long loopTime = micros() - loopStart;
   unsigned long totalTime = _avgLoopTimeUs * _loopTimeMeasurementCount;
   _loopTimeMeasurementCount++;
 
   _avgLoopTimeUs = (totalTime + loopTime) / _loopTimeMeasurementCount;
+  if (loopTime > _maxLoopTimeUs) {
+    _maxLoopTimeUs = loopTime;
+  }
+
+  xrp::crashlogUpdateLoopStats(_avgLoopTimeUs, _maxLoopTimeUs);
+  xrp::overloadRecordLoopTime(loopTime);
 }
 
 
 void setup() {
+  // Grab whatever the last run left behind before anything overwrites it
+  xrp::crashlogInit();
+  xrp::memstatsPaintStack();
+
   // Generate the default SSID using the flash ID
   pico_unique_board_id_t id_out;
   pico_get_unique_board_id(&id_out);
   sprintf(chipID, "%02x%02x-%02x%02x", id_out.id[4], id_out.id[5], id_out.id[6], id_out.id[7]);
   sprintf(DEFAULT_SSID, "XRP-%s", chipID);
 
+  // Parse the firmware version for the capabilities tag
+  size_t versionLen;
+  std::string versionString{reinterpret_cast<const char*>(GetResource_VERSION(&versionLen)), versionLen};
+  unsigned int major = 0, minor = 0, patch = 0;
+  sscanf(versionString.c_str(), "%u.%u.%u", &major, &minor, &patch);
+  fwVersion[0] = major;
+  fwVersion[1] = minor;
+  fwVersion[2] = patch;
+
   Serial.begin(115200);
   LittleFS.begin();
+  xrp::crashlogPersist();
+  xrp::otaInit();
 
   // Set up the I2C pins
   Wire1.setSCL(19);
@@ -265,13 +696,17 @@ void setup() {
 
   // Read Config
   config = loadConfiguration(DEFAULT_SSID);
+  xrp::setDriveRightInverted(config.driveConfig.rightInverted);
 
   // Initialize IMU
   Serial.println("[IMU] Initializing IMU");
   xrp::imuInit(IMU_I2C_ADDR, &Wire1);
 
   Serial.println("[IMU] Beginning IMU calibration");
+  xrp::imuConfigureSensor(config.imuConfig.odrHz, config.imuConfig.accelRangeG,
+      config.imuConfig.gyroRangeDps, config.imuConfig.filters);
   xrp::imuCalibrate(5000);
+  xrp::imuConfigureMotionEvents(IMU_MOTION_IMPACT_DEFAULT_MG, IMU_MOTION_TILT_DEFAULT_DEG, IMU_MOTION_FREEFALL_DEFAULT_MS);
 
   // Busy-loop if there's no WiFi hardware
   if (WiFi.status() == WL_NO_MODULE) {
@@ -296,6 +731,12 @@ void setup() {
   // Set up UDP
   udp.begin(3540);
   Serial.println("[NET] UDP socket listening on *:3540");
+  xrp::discoveryBegin();
+
+  if (config.groupConfig.enabled) {
+    xrp::groupBegin(config.groupConfig.address.c_str(), config.groupConfig.port,
+        config.groupConfig.robotId, config.groupConfig.groupIndex, config.groupConfig.sender.c_str());
+  }
 
   Serial.println("[NET] Network Ready");
   Serial.printf("[NET] SSID: %s\n", WiFi.SSID().c_str());
@@ -303,13 +744,24 @@ void setup() {
 
   xrp::robotInit();
 
-  // NOTE: For now, we'll force init the reflectance sensor
-  // TODO Enable this via configuration
-  xrp::reflectanceInit();
+  // Only start up the sensors that are actually plugged in
+  Serial.println("[XRP] Probing for reflectance sensor");
+  if (xrp::reflectanceProbe()) {
+    Serial.println("  - Detected");
+    xrp::reflectanceInit();
+  }
+  else {
+    Serial.println("  - Not detected");
+  }
 
-  // NOTE: For now we'll force init the rangefinder
-  // TODO enable this via configuration
-  xrp::rangefinderInit();
+  Serial.println("[XRP] Probing for rangefinder");
+  if (xrp::rangefinderProbe()) {
+    Serial.println("  - Detected");
+    xrp::rangefinderInit();
+  }
+  else {
+    Serial.println("  - Not detected");
+  }
 
   _lastMessageStatusPrint = millis();
   _baselineUsedHeap = rp2040.getUsedHeap();
@@ -317,46 +769,167 @@ void setup() {
   // Write current status file
   writeStatusToDisk();
   singleFileDrive.begin("status.txt", "XRP-Status.txt");
+
+  // From here on, core 0 hanging resets the board (and leaves a crash log)
+  rp2040.wdt_begin(XRP_HW_WATCHDOG_TIMEOUT_MS);
+}
+
+/**
+ * Step a running SysId test. A test steps every 1ms, which is about as long
+ * as a trip round the loop takes, so loop() calls this twice: at the start
+ * and again halfway through
+ */
+void runSysId() {
+  if (!xrp::sysidRunning()) return;
+
+  markSpan(XRP_SPAN_SYSID);
+  unsigned long startTime = micros();
+  xrp::sysidPeriodic();
+  xrp::cpuloadTaskEnd(XRP_CPU_TASK_SYSID, startTime, true);
 }
 
 void loop() {
   unsigned long loopStartTime = micros();
+  unsigned long taskStartTime;
+  rp2040.wdt_reset();
+  markSpan(XRP_SPAN_LOOP_START);
+  runSysId();
+
+  // The web server is the first thing to go when we're overloaded, or
+  // when a SysId test needs the loop to itself
+  if (!xrp::sysidRunning() &&
+      (!xrp::overloadShedding(XRP_OVERLOAD_LEVEL_WEB) ||
+       millis() - _lastWebServiceTime >= XRP_OVERLOAD_WEB_INTERVAL_MS)) {
+    // The web server doesn't tell us if it handled anything, so go by how long it took
+    markSpan(XRP_SPAN_WEB);
+    taskStartTime = micros();
+    webServer.handleClient();
+    xrp::cpuloadTaskEnd(XRP_CPU_TASK_WEB, taskStartTime, micros() - taskStartTime > XRP_CPU_POLL_THRESHOLD_US);
+    _lastWebServiceTime = millis();
+  }
 
-  webServer.handleClient();
+  markSpan(XRP_SPAN_UDP_RX);
+  taskStartTime = micros();
+  int packetsReceived = 0;
+  for (; packetsReceived < XRP_UDP_MAX_PACKETS_PER_LOOP; packetsReceived++) {
+    int packetSize = udp.parsePacket();
+    if (!packetSize) break;
+
+    // Screen the sender before looking at the payload. Anything we don't
+    // read gets thrown away by the next parsePacket()
+    if (xrp::udpGuardCheck(udp.remoteIP(), udp.remotePort(), unicastSessionActive(), udpRemoteAddr, udpRemotePort) != xrp::UDP_ADMIT) {
+      continue;
+    }
 
-  int packetSize = udp.parsePacket();
-  if (packetSize) {
     updateRemoteInfo();
 
     // Read the packet
     int n = udp.read(udpPacketBuf, UDP_TX_PACKET_MAX_SIZE);
-    wpilibudp::processPacket(udpPacketBuf, n);
+    if (wpilibudp::processPacket(udpPacketBuf, n)) {
+      _lastUnicastPacketTime = millis();
+      // Only hosts that sent a Hello have opted in to a faster telemetry rate
+      if (wpilibudp::negotiatedProtocolVersion() >= 1) {
+        xrp::telemetrySyncOnCommand(micros());
+      }
+    }
   }
 
-  xrp::imuPeriodic();
+  xrp::groupPoll(unicastSessionActive());
+  xrp::groupPeriodic();
+
+  if (xrp::discoveryPoll()) {
+    sendDiscoveryReply();
+    packetsReceived++;
+  }
+  xrp::cpuloadTaskEnd(XRP_CPU_TASK_UDP, taskStartTime, packetsReceived > 0);
+
+  runSysId();
+
+  markSpan(XRP_SPAN_IMU);
+  taskStartTime = micros();
+  xrp::imuSetBiasLearning(xrp::robotAtRest());
+  bool imuUpdated = xrp::imuPeriodic();
+  xrp::cpuloadTaskEnd(XRP_CPU_TASK_IMU, taskStartTime, imuUpdated);
+  handleMotionEvents(xrp::imuTakeMotionEvents());
+  // Saving the bias model writes flash, which stalls this core and idles
+  // core 1. Only do it when a session ends (robot disabled, or the host is
+  // gone), never while a host is connected and waiting
+  bool robotEnabled = xrp::robotEnabled();
+  if ((_robotWasEnabled && !robotEnabled) || !wpilibudp::dsWatchdogActive()) {
+    xrp::imuBiasModelSave();
+  }
+  _robotWasEnabled = robotEnabled;
   xrp::rangefinderPollForData();
 
   // Disable the robot when the UDP watchdog timesout
   // Also reset the max sequence number so we can handle reconnects
   if (!wpilibudp::dsWatchdogActive()) {
+    if (_dsWatchdogWasActive) {
+      xrp::eventsPost(XRP_EVENT_DS_WATCHDOG_TRIP);
+    }
     wpilibudp::resetState();
+    xrp::groupResetState();
     xrp::robotSetEnabled(false);
     xrp::imuSetEnabled(false);
   }
+  _dsWatchdogWasActive = wpilibudp::dsWatchdogActive();
+
+  markSpan(XRP_SPAN_ROBOT);
+  taskStartTime = micros();
+  uint8_t robotData = xrp::robotPeriodic();
+  xrp::cpuloadTaskEnd(XRP_CPU_TASK_ROBOT, taskStartTime, robotData != 0);
 
-  if (xrp::robotPeriodic()) {
+  if (robotData) {
     // Package up and send all the data
+    markSpan(XRP_SPAN_TELEMETRY);
+    taskStartTime = micros();
     sendData();
+    xrp::cpuloadTaskEnd(XRP_CPU_TASK_TELEMETRY, taskStartTime, true);
+  }
+  else if (eventsWanted() && xrp::eventsDue()) {
+    markSpan(XRP_SPAN_TELEMETRY);
+    taskStartTime = micros();
+    sendEvents();
+    xrp::cpuloadTaskEnd(XRP_CPU_TASK_TELEMETRY, taskStartTime, true);
+  }
+  else if (xrp::sysidStreamDue()) {
+    markSpan(XRP_SPAN_TELEMETRY);
+    taskStartTime = micros();
+    sendSysIdData();
+    xrp::cpuloadTaskEnd(XRP_CPU_TASK_TELEMETRY, taskStartTime, true);
   }
 
+  markSpan(XRP_SPAN_STATUS);
   updateLoopTime(loopStartTime);
+  xrp::otaPeriodic();
+  xrp::cpuloadPeriodic();
+  xrp::overloadPeriodic();
+  xrp::livenessCheckCore1();
   checkPrintStatus();
 }
 
+void setup1() {
+  xrp::memstatsPaintStack();
+}
+
 void loop1() {
+  xrp::livenessBeat();
+  unsigned long measureStart = millis();
+
   if (xrp::rangefinderInitialized()) {
+    xrp::crashlogMark(XRP_SPAN_RANGEFINDER);
+    unsigned long taskStartTime = micros();
     xrp::rangefinderPeriodic();
+    xrp::cpuloadTaskEnd(XRP_CPU_TASK_RANGEFINDER, taskStartTime, true);
   }
 
-  delay(50);
+  xrp::cpuloadPeriodic();
+
+  // Wait for the next measurement, keeping an eye on core 0 while we do
+  xrp::crashlogMark(XRP_SPAN_CORE1_IDLE);
+  while (millis() - measureStart < XRP_RANGEFINDER_PERIOD_MS) {
+    xrp::livenessBeat();
+    xrp::livenessCheckCore0();
+    delay(1);
+  }
 }
@@ -0,0 +1,111 @@
+#include "memstats.h"
+
+#include <Arduino.h>
+#include <malloc.h>
+
+// Stack regions from the linker script. Core 0 runs on __StackBottom to
+// __StackTop and core 1 on __StackOneBottom to __StackOneTop
+extern "C" {
+extern uint32_t __StackBottom;
+extern uint32_t __StackTop;
+extern uint32_t __StackOneBottom;
+extern uint32_t __StackOneTop;
+}
+
+namespace xrp {
+
+bool _stackPainted[2] = {false, false};
+
+void _stackBounds(int core, uint32_t** bottom, uint32_t** top) {
+  if (core == 0) {
+    *bottom = &__StackBottom;
+    *top = &__StackTop;
+  }
+  else {
+    *bottom = &__StackOneBottom;
+    *top = &__StackOneTop;
+  }
+}
+
+void memstatsPaintStack() {
+  int core = get_core_num();
+  uint32_t* bottom;
+  uint32_t* top;
+  _stackBounds(core, &bottom, &top);
+
+  uint32_t* sp = (uint32_t*)__builtin_frame_address(0);
+
+  // The core may have been started on a stack somewhere else (e.g. on the
+  // heap). We can't measure that one
+  if (sp < bottom || sp > top) {
+    Serial.printf("[MEM] Core %d stack is not in the expected region\n", core);
+    return;
+  }
+
+  uint32_t* paintEnd = sp - (XRP_STACK_PAINT_MARGIN / sizeof(uint32_t));
+  for (uint32_t* p = bottom; p < paintEnd; p++) {
+    *p = XRP_STACK_PAINT_PATTERN;
+  }
+
+  _stackPainted[core] = true;
+}
+
+int memstatsStackSize(int core) {
+  if (!_stackPainted[core]) return -1;
+
+  uint32_t* bottom;
+  uint32_t* top;
+  _stackBounds(core, &bottom, &top);
+  return (top - bottom) * sizeof(uint32_t);
+}
+
+int memstatsStackHighWater(int core) {
+  if (!_stackPainted[core]) return -1;
+
+  uint32_t* bottom;
+  uint32_t* top;
+  _stackBounds(core, &bottom, &top);
+
+  // The stack grows down, so the first word that isn't paint is the
+  // deepest the stack has ever been
+  uint32_t* p = bottom;
+  while (p < top && *p == XRP_STACK_PAINT_PATTERN) {
+    p++;
+  }
+  return (top - p) * sizeof(uint32_t);
+}
+
+size_t memstatsHeapTotal() {
+  return rp2040.getTotalHeap();
+}
+
+size_t memstatsHeapUsed() {
+  return rp2040.getUsedHeap();
+}
+
+/**
+ * Peak heap extent.
+ *
+ * newlib never gives memory back to the system, so the size of its arena is
+ * the most heap that has ever been in use at once (plus fragmentation)
+ */
+size_t memstatsHeapPeak() {
+  struct mallinfo mi = mallinfo();
+  return mi.arena;
+}
+
+/**
+ * Contiguous free space at the top of the heap.
+ *
+ * This is the free chunk at the top of the arena plus everything that
+ * hasn't been handed to the arena yet. It is not the largest free block:
+ * holes further down may be bigger, but newlib doesn't give us a cheap way
+ * to find them. A block this size can always be allocated, so it is a
+ * lower bound when sizing buffers.
+ */
+size_t memstatsHeapTopFree() {
+  struct mallinfo mi = mallinfo();
+  return (memstatsHeapTotal() - mi.arena) + mi.keepcost;
+}
+
+} // namespace xrp
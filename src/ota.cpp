@@ -0,0 +1,219 @@
+#include "ota.h"
+#include "liveness.h"
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <Updater.h>
+
+#define OTA_STATE_FILE "/ota.txt"
+
+namespace xrp {
+
+const char* _otaStateStrings[] = {
+  "none",
+  "pending",
+  "trial",
+  "confirmed",
+  "failed"
+};
+
+OtaState _otaState = OTA_STATE_NONE;
+uint32_t _otaImageCrc = 0;
+
+bool _otaInProgress = false;
+uint32_t _otaExpectedCrc = 0;
+uint32_t _otaRunningCrc = 0;
+size_t _otaBytesWritten = 0;
+const char* _otaLastError = "";
+
+unsigned long _otaRebootAt = 0;
+
+// Bitwise CRC32 (same polynomial as zlib). Slow per byte, but it's only
+// run over upload chunks, which arrive far slower than this
+uint32_t _crc32Update(uint32_t crc, const uint8_t* buf, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void _otaWriteState(OtaState state) {
+  _otaState = state;
+  livenessPause();
+  File f = LittleFS.open(OTA_STATE_FILE, "w");
+  if (!f) {
+    livenessResume();
+    Serial.println("[OTA] Failed to save update state");
+    return;
+  }
+  f.printf("%d %08lx\n", (int)state, (unsigned long)_otaImageCrc);
+  f.close();
+  livenessResume();
+}
+
+void otaInit() {
+  if (!LittleFS.exists(OTA_STATE_FILE)) return;
+
+  File f = LittleFS.open(OTA_STATE_FILE, "r");
+  int state = (int)OTA_STATE_NONE;
+  if (f) {
+    state = f.parseInt();
+    _otaImageCrc = strtoul(f.readStringUntil('\n').c_str(), nullptr, 16);
+    f.close();
+  }
+
+  switch (state) {
+    case OTA_STATE_PENDING:
+      // The bootloader installed the staged image before we got here
+      Serial.printf("[OTA] Running new firmware (crc %08lx). Health check in %d ms\n",
+          (unsigned long)_otaImageCrc, XRP_OTA_HEALTH_CHECK_MS);
+      _otaWriteState(OTA_STATE_TRIAL);
+      break;
+    case OTA_STATE_TRIAL:
+      // We were still on trial when the last run ended, so it didn't make it
+      Serial.printf("[OTA] New firmware (crc %08lx) failed its health check\n",
+          (unsigned long)_otaImageCrc);
+      _otaWriteState(OTA_STATE_FAILED);
+      break;
+    case OTA_STATE_CONFIRMED:
+    case OTA_STATE_FAILED:
+      _otaState = (OtaState)state;
+      break;
+    default:
+      _otaState = OTA_STATE_NONE;
+      break;
+  }
+}
+
+void otaPeriodic() {
+  if (_otaState == OTA_STATE_TRIAL && millis() > XRP_OTA_HEALTH_CHECK_MS) {
+    Serial.println("[OTA] New firmware passed its health check");
+    _otaWriteState(OTA_STATE_CONFIRMED);
+  }
+
+  if (_otaRebootAt != 0 && (long)(millis() - _otaRebootAt) >= 0) {
+    Serial.println("[OTA] Rebooting to install new firmware");
+    rp2040.reboot();
+  }
+}
+
+bool otaBegin(uint32_t expectedCrc, size_t imageSize) {
+  if (_otaInProgress) {
+    otaAbort();
+  }
+
+  if (imageSize == 0) {
+    _otaLastError = "Missing image size";
+    Serial.println("[OTA] Firmware upload is missing its size");
+    return false;
+  }
+
+  // The image is staged in the filesystem, so that's how much room we have.
+  // Keep a block spare for the filesystem's own bookkeeping
+  FSInfo info;
+  LittleFS.info(info);
+  size_t freeBytes = info.totalBytes > info.usedBytes ? info.totalBytes - info.usedBytes : 0;
+  size_t maxSize = freeBytes > 0x1000 ? (freeBytes - 0x1000) & ~0xFFF : 0;
+
+  if (imageSize > maxSize) {
+    _otaLastError = "Not enough space to stage the image";
+    Serial.printf("[OTA] Image is %u bytes, only %u free\n", imageSize, maxSize);
+    return false;
+  }
+
+  if (!Update.begin(imageSize)) {
+    _otaLastError = "Failed to start staging the image";
+    Serial.printf("[OTA] Update.begin failed (error %d)\n", Update.getError());
+    return false;
+  }
+
+  _otaInProgress = true;
+  _otaExpectedCrc = expectedCrc;
+  _otaRunningCrc = 0;
+  _otaBytesWritten = 0;
+  _otaLastError = "";
+  Serial.printf("[OTA] Receiving firmware (crc %08lx)\n", (unsigned long)expectedCrc);
+  return true;
+}
+
+bool otaWrite(const uint8_t* buf, size_t len) {
+  if (!_otaInProgress) return false;
+
+  if (Update.write(const_cast<uint8_t*>(buf), len) != len) {
+    _otaLastError = "Failed to write the image";
+    Serial.printf("[OTA] Write failed at offset %u (error %d)\n", _otaBytesWritten, Update.getError());
+    otaAbort();
+    return false;
+  }
+
+  _otaRunningCrc = _crc32Update(_otaRunningCrc, buf, len);
+  _otaBytesWritten += len;
+  return true;
+}
+
+bool otaEnd() {
+  if (!_otaInProgress) return false;
+  _otaInProgress = false;
+
+  if (_otaBytesWritten == 0) {
+    _otaLastError = "Empty image";
+    Update.end(false);
+    return false;
+  }
+
+  if (_otaRunningCrc != _otaExpectedCrc) {
+    _otaLastError = "CRC mismatch";
+    Serial.printf("[OTA] CRC mismatch. Expected %08lx, got %08lx. Discarding image\n",
+        (unsigned long)_otaExpectedCrc, (unsigned long)_otaRunningCrc);
+    // Not finished and not forced, so nothing gets staged
+    Update.end(false);
+    return false;
+  }
+
+  if (!Update.end(true)) {
+    _otaLastError = "Failed to stage the image";
+    Serial.printf("[OTA] Update.end failed (error %d)\n", Update.getError());
+    return false;
+  }
+
+  _otaImageCrc = _otaRunningCrc;
+  _otaWriteState(OTA_STATE_PENDING);
+  _otaRebootAt = millis() + XRP_OTA_REBOOT_DELAY_MS;
+  Serial.printf("[OTA] Staged %u bytes. Installing on reboot\n", _otaBytesWritten);
+  return true;
+}
+
+void otaAbort() {
+  if (!_otaInProgress) return;
+  _otaInProgress = false;
+  Update.end(false);
+  Serial.printf("[OTA] Upload aborted after %u bytes\n", _otaBytesWritten);
+}
+
+void otaReject(const char* error) {
+  otaAbort();
+  _otaLastError = error;
+  Serial.printf("[OTA] Upload rejected: %s\n", error);
+}
+
+bool otaInProgress() {
+  return _otaInProgress;
+}
+
+const char* otaLastError() {
+  return _otaLastError;
+}
+
+OtaState otaState() {
+  return _otaState;
+}
+
+const char* otaStateString() {
+  return _otaStateStrings[_otaState];
+}
+
+} // namespace xrp
@@ -0,0 +1,160 @@
+#include "overload.h"
+#include "events.h"
+#include "imu.h"
+
+#include <Arduino.h>
+
+namespace xrp {
+
+// Loop time histogram. Each bucket counts loops that took at most this long
+const unsigned long _loopTimeBucketsUs[] = {
+  100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 0xFFFFFFFF
+};
+const int _numLoopTimeBuckets = sizeof(_loopTimeBucketsUs) / sizeof(_loopTimeBucketsUs[0]);
+
+unsigned long _loopTimeHistogram[_numLoopTimeBuckets];
+unsigned long _loopTimeSamples = 0;
+unsigned long _loopTimePercentileUs = 0;
+
+unsigned long _overloadWindowStart = 0;
+uint8_t _overloadLevel = XRP_OVERLOAD_LEVEL_NONE;
+unsigned long _overloadLevelStart = 0;
+unsigned long _overloadTimeAtLevelMs[XRP_OVERLOAD_NUM_LEVELS];
+int _overloadQuietWindows = 0;
+
+const char* _overloadLevelNames[XRP_OVERLOAD_NUM_LEVELS] = {
+  "none",
+  "web",
+  "telemetry",
+  "imu"
+};
+
+void overloadRecordLoopTime(unsigned long loopTimeUs) {
+  for (int i = 0; i < _numLoopTimeBuckets; i++) {
+    if (loopTimeUs <= _loopTimeBucketsUs[i]) {
+      _loopTimeHistogram[i]++;
+      break;
+    }
+  }
+  _loopTimeSamples++;
+}
+
+unsigned long _computePercentile() {
+  unsigned long target = (_loopTimeSamples * XRP_OVERLOAD_PERCENTILE + 99) / 100;
+  unsigned long count = 0;
+  for (int i = 0; i < _numLoopTimeBuckets; i++) {
+    count += _loopTimeHistogram[i];
+    if (count >= target) {
+      return _loopTimeBucketsUs[i];
+    }
+  }
+  return _loopTimeBucketsUs[_numLoopTimeBuckets - 1];
+}
+
+// IMU filter rate from before we started shedding it, and the rate we set
+int _overloadSavedFilterRateHz = IMU_MADGWICK_LOOP_FREQ_HZ;
+int _overloadShedFilterRateHz = 0;
+
+void _setOverloadLevel(uint8_t level) {
+  unsigned long now = millis();
+  unsigned long heldMs = now - _overloadLevelStart;
+  _overloadTimeAtLevelMs[_overloadLevel] += heldMs;
+
+  Serial.printf("[OVERLOAD] Level %s -> %s (p%d loop time %lu us). Was at %s for %lu ms\n",
+      _overloadLevelNames[_overloadLevel], _overloadLevelNames[level],
+      XRP_OVERLOAD_PERCENTILE, _loopTimePercentileUs,
+      _overloadLevelNames[_overloadLevel], heldMs);
+
+  // Drop the IMU rate on the way in, restore it on the way out (whatever it
+  // was configured to). If the host reconfigured the IMU in the meantime,
+  // its rate wins
+  if (level >= XRP_OVERLOAD_LEVEL_IMU && _overloadLevel < XRP_OVERLOAD_LEVEL_IMU) {
+    _overloadSavedFilterRateHz = imuGetFilterRate();
+    imuSetFilterRate(_overloadSavedFilterRateHz / 2);
+    _overloadShedFilterRateHz = imuGetFilterRate();
+  }
+  else if (level < XRP_OVERLOAD_LEVEL_IMU && _overloadLevel >= XRP_OVERLOAD_LEVEL_IMU) {
+    if (imuGetFilterRate() == _overloadShedFilterRateHz) {
+      imuSetFilterRate(_overloadSavedFilterRateHz);
+    }
+  }
+
+  _overloadLevel = level;
+  _overloadLevelStart = now;
+  eventsPost(XRP_EVENT_OVERLOAD, level);
+}
+
+void overloadPeriodic() {
+  unsigned long now = millis();
+  if (_overloadWindowStart == 0) {
+    _overloadWindowStart = now;
+    _overloadLevelStart = now;
+    return;
+  }
+
+  if (now - _overloadWindowStart < XRP_OVERLOAD_WINDOW_MS) return;
+  _overloadWindowStart = now;
+
+  if (_loopTimeSamples == 0) {
+    // Not a single loop finished in the whole window
+    _loopTimePercentileUs = _loopTimeBucketsUs[_numLoopTimeBuckets - 1];
+  }
+  else {
+    _loopTimePercentileUs = _computePercentile();
+  }
+
+  for (int i = 0; i < _numLoopTimeBuckets; i++) {
+    _loopTimeHistogram[i] = 0;
+  }
+  _loopTimeSamples = 0;
+
+  if (_loopTimePercentileUs > XRP_OVERLOAD_HIGH_US) {
+    _overloadQuietWindows = 0;
+    if (_overloadLevel < XRP_OVERLOAD_NUM_LEVELS - 1) {
+      _setOverloadLevel(_overloadLevel + 1);
+    }
+  }
+  else if (_loopTimePercentileUs <= XRP_OVERLOAD_LOW_US) {
+    if (_overloadLevel > XRP_OVERLOAD_LEVEL_NONE &&
+        ++_overloadQuietWindows >= XRP_OVERLOAD_RECOVER_WINDOWS) {
+      _overloadQuietWindows = 0;
+      _setOverloadLevel(_overloadLevel - 1);
+    }
+  }
+  else {
+    _overloadQuietWindows = 0;
+  }
+}
+
+uint8_t overloadLevel() {
+  return _overloadLevel;
+}
+
+bool overloadShedding(uint8_t level) {
+  return _overloadLevel >= level;
+}
+
+const char* overloadLevelName(uint8_t level) {
+  if (level >= XRP_OVERLOAD_NUM_LEVELS) return "unknown";
+  return _overloadLevelNames[level];
+}
+
+unsigned long overloadLoopTimePercentileUs() {
+  return _loopTimePercentileUs;
+}
+
+unsigned long overloadLevelDurationMs() {
+  return millis() - _overloadLevelStart;
+}
+
+unsigned long overloadTimeAtLevelMs(uint8_t level) {
+  if (level >= XRP_OVERLOAD_NUM_LEVELS) return 0;
+
+  unsigned long total = _overloadTimeAtLevelMs[level];
+  if (level == _overloadLevel) {
+    total += millis() - _overloadLevelStart;
+  }
+  return total;
+}
+
+} // namespace xrp
@@ -1,23 +1,40 @@
 #include "robot.h"
 #include "encoder.pio.h"
+#include "events.h"
+#include "imu.h"
+#include "liveness.h"
+#include "telemetrysync.h"
 #include "wpilibudp.h"
 
-#include <map>
 #include <vector>
 
 #include <Servo.h>
+#include <hardware/adc.h>
+#include <hardware/clocks.h>
+#include <hardware/gpio.h>
 
 #define REFLECT_LEFT_PIN 26
 #define REFLECT_RIGHT_PIN 27
 
+// A floating ADC input follows the internal pulls; a driven one doesn't
+#define REFLECT_PROBE_FLOAT_DELTA 2048
+#define REFLECT_PROBE_SETTLE_US 500
+
 #define ULTRASONIC_TRIG_PIN 20
 #define ULTRASONIC_ECHO_PIN 21
 #define ULTRASONIC_MAX_PULSE_WIDTH 23200
+// Max time between the trigger and the start of the echo pulse
+#define ULTRASONIC_ECHO_START_TIMEOUT_US 30000
+#define ULTRASONIC_PROBE_ATTEMPTS 3
+
+// Proximity stop releases once the obstacle is this much further than the limit
+#define PROXIMITY_STOP_HYSTERESIS_MM 50
 
 namespace xrp {
 
 bool _robotInitialized = false;
 bool _robotEnabled = false;
+bool _safetyStopped = false;
 unsigned long _lastRobotPeriodicCall = 0;
 
 // Digital IO
@@ -27,6 +44,27 @@ bool _lastUserButtonState = false;
 Servo servo1;
 Servo servo2;
 
+// Per-channel command freshness
+unsigned long _pwmLastUpdateTime[XRP_NUM_PWM_CHANNELS] = {0, 0, 0, 0, 0, 0};
+double _pwmLastValue[XRP_NUM_PWM_CHANNELS] = {0, 0, 0, 0, 0, 0};
+unsigned long _pwmTimeoutMs[XRP_NUM_PWM_CHANNELS] = {0, 0, 0, 0, 0, 0};
+unsigned long _pwmRampMs[XRP_NUM_PWM_CHANNELS] = {0, 0, 0, 0, 0, 0};
+uint8_t _pwmFallback[XRP_NUM_PWM_CHANNELS] = {
+  XRP_ACTUATOR_FALLBACK_ZERO, XRP_ACTUATOR_FALLBACK_ZERO, XRP_ACTUATOR_FALLBACK_ZERO,
+  XRP_ACTUATOR_FALLBACK_ZERO, XRP_ACTUATOR_FALLBACK_ZERO, XRP_ACTUATOR_FALLBACK_ZERO
+};
+bool _pwmStale[XRP_NUM_PWM_CHANNELS] = {false, false, false, false, false, false};
+bool _pwmClaimed[XRP_NUM_PWM_CHANNELS] = {false, false, false, false, false, false};
+
+// What actually reached each output (servos in -1 to 1, like the commands
+// internally), and why it differs from the command
+float _pwmApplied[XRP_NUM_PWM_CHANNELS] = {0, 0, 0, 0, 0, 0};
+uint8_t _pwmReason[XRP_NUM_PWM_CHANNELS] = {
+  XRP_ACTUATOR_REASON_NONE, XRP_ACTUATOR_REASON_NONE, XRP_ACTUATOR_REASON_NONE,
+  XRP_ACTUATOR_REASON_NONE, XRP_ACTUATOR_REASON_NONE, XRP_ACTUATOR_REASON_NONE
+};
+unsigned long _lastFreshnessRampTime = 0;
+
 // Encoder PIO
 PIO _encoderPio = nullptr;
 uint _encoderPgmOffset = 0;
@@ -40,11 +78,21 @@ std::vector<std::pair<int, int> > _encoderPins = {
   {8, 9}
 };
 
-int _encoderValuesLast[4] = {0, 0, 0, 0};
-int _encoderValues[4] = {0, 0, 0, 0};
+// Raw 32-bit counts as last read from the state machines. These are only
+// used to compute deltas; the accumulated 64-bit counts are the real values
+uint32_t _encoderRawLast[4] = {0, 0, 0, 0};
+int64_t _encoderAccum[4] = {0, 0, 0, 0};
+int64_t _encoderAccumLast[4] = {0, 0, 0, 0};
+int64_t _encoderOffsets[4] = {0, 0, 0, 0};
+unsigned long _encoderLastMoveTime = 0;
+unsigned long _encoderWrapCount[4] = {0, 0, 0, 0};
 int _encoderStateMachineIdx[4] = {-1, -1, -1, -1};
 PIO _encoderPioInstance[4] = {nullptr, nullptr, nullptr, nullptr};
-std::map<int, int> _encoderWPILibChannelToNativeMap;
+
+// WPILib encoder device -> native encoder index (-1 if not configured)
+int _encoderWPILibChannelToNative[XRP_MAX_ENCODER_DEVICES] = {-1, -1, -1, -1, -1, -1, -1, -1};
+bool _encoderWPILibReversed[XRP_MAX_ENCODER_DEVICES] = {false, false, false, false, false, false, false, false};
+int _numConfiguredEncoders = 0;
 
 // Reflectance
 bool _reflectanceInitialized = false;
@@ -53,8 +101,35 @@ bool _reflectanceInitialized = false;
 bool _rangefinderInitialized = false;
 float _rangefinderDistMetres = 0.0f;
 const float RANGEFINDER_MAX_DIST_M = 4.0f;
+// Core 1 sends this when there was no echo
+const float RANGEFINDER_NO_ECHO = -1.0f;
+
+// Filtering (core 0)
+float _rangefinderSamples[XRP_RANGEFINDER_FILTER_SIZE];
+int _rangefinderSampleIdx = 0;
+bool _rangefinderValid = false;
+unsigned long _rangefinderRateWindowStart = 0;
+int _rangefinderRateWindowCount = 0;
+float _rangefinderRateHz = 0.0f;
+
+// Proximity stop
+uint16_t _proximityStopMm = 0;
+bool _proximityStopActive = false;
+// WPILib's XRPDrivetrain inverts the right motor
+bool _driveRightInverted = true;
 
 // Internal helper functions
+float _encoderClkDivForSampleInterval(unsigned long intervalNs) {
+  // Each sample takes encoder_CYCLES_PER_SAMPLE state machine cycles
+  float sysClkNs = 1e9f / (float)clock_get_hz(clk_sys);
+  float clkdiv = (float)intervalNs / (sysClkNs * encoder_CYCLES_PER_SAMPLE);
+
+  // The PIO clock divider is limited to [1, 65536)
+  if (clkdiv < 1.0f) clkdiv = 1.0f;
+  if (clkdiv > 65535.0f) clkdiv = 65535.0f;
+  return clkdiv;
+}
+
 bool _initEncoders() {
   for (int i = 0; i < 4; i++) {
     int _pgmOffset = -1;
@@ -72,14 +147,14 @@ bool _initEncoders() {
 
     // Init the program
     auto pins = _encoderPins.at(i);
-    encoder_program_init(_pio, _smIdx, _pgmOffset, pins.first);
+    encoder_program_init(_pio, _smIdx, _pgmOffset, pins.first, _encoderClkDivForSampleInterval(XRP_ENCODER_SAMPLE_INTERVAL_NS));
   }
 
   return true;
 }
 
-int _readEncoderInternal(PIO _pio, uint _smIdx) {
-  int count;
+uint32_t _readEncoderInternal(PIO _pio, uint _smIdx) {
+  uint32_t count;
 
   // Read 5 times to get past buffer
   count = pio_sm_get_blocking(_pio, _smIdx);
@@ -91,22 +166,44 @@ int _readEncoderInternal(PIO _pio, uint _smIdx) {
   return count;
 }
 
+/**
+ * Fold the current state machine count into the 64-bit accumulator.
+ *
+ * The state machine counts in a 32-bit register that wraps. As long as we
+ * read it at least once every 2^31 counts, the signed difference between
+ * two reads is the true movement, wrap or not.
+ */
+void _updateEncoderInternal(int idx) {
+  PIO _pio = _encoderPioInstance[idx];
+  uint _smIdx = _encoderStateMachineIdx[idx];
+
+  if (_pio == nullptr) return;
+
+  uint32_t raw = _readEncoderInternal(_pio, _smIdx);
+  int32_t delta = (int32_t)(raw - _encoderRawLast[idx]);
+
+  // Detect the raw register crossing the signed 32-bit boundary
+  if (((int32_t)raw < 0) != ((int32_t)_encoderRawLast[idx] < 0) &&
+      (((int32_t)raw < 0) == (delta > 0))) {
+    _encoderWrapCount[idx]++;
+    Serial.printf("[ENC-%d] Raw count wrapped (%lu)\n", idx, _encoderWrapCount[idx]);
+  }
+
+  _encoderRawLast[idx] = raw;
+  _encoderAccum[idx] += delta;
+}
+
 bool _readEncodersInternal() {
-  unsigned long _start = millis();
   bool hasChange = false;
   for (int i = 0; i < 4; i++) {
-    PIO _pio = _encoderPioInstance[i];
-    uint _smIdx = _encoderStateMachineIdx[i];
+    _updateEncoderInternal(i);
 
-    if (_pio != nullptr) {
-      _encoderValues[i] = _readEncoderInternal(_pio, _smIdx);
-
-      if (_encoderValues[i] != _encoderValuesLast[i]) {
-        hasChange = true;
-      }
-
-      _encoderValuesLast[i] = _encoderValues[i];
+    if (_encoderAccum[i] != _encoderAccumLast[i]) {
+      hasChange = true;
+      _encoderLastMoveTime = millis();
     }
+
+    _encoderAccumLast[i] = _encoderAccum[i];
   }
 
   return hasChange;
@@ -149,16 +246,23 @@ bool _initServos() {
   return success;
 }
 
-void _setMotorPwmValueInternal(int en, int ph, double value) {
+// Returns the value that was actually applied
+double _setMotorPwmValueInternal(int en, int ph, double value) {
   PinStatus phValue = (value < 0.0) ? LOW : HIGH;
   int enValue = (abs(value) * 255);
+  if (enValue > 255) enValue = 255;
 
   digitalWrite(ph, phValue);
   analogWrite(en, enValue);
+
+  return (value < 0.0 ? -enValue : enValue) / 255.0;
 }
 
-void _setServoPwmValueInternal(int servoIdx, double value) {
+// Returns the value that was actually applied
+double _setServoPwmValueInternal(int servoIdx, double value) {
   int val = ((value + 1.0) / 2.0) * 180;
+  if (val < 0) val = 0;
+  if (val > 180) val = 180;
 
   if (servoIdx == 0 && servo1.attached()) {
     servo1.write(val);
@@ -166,45 +270,174 @@ void _setServoPwmValueInternal(int servoIdx, double value) {
   else if (servoIdx == 1 && servo2.attached()) {
     servo2.write(val);
   }
+
+  return ((val / 180.0) * 2.0) - 1.0;
 }
 
 void _setPwmValueInternal(int channel, double value, bool override) {
-  if (!_robotEnabled && !override) return;
+  if (channel < 0 || channel >= XRP_NUM_PWM_CHANNELS) return;
+
+  if (!_robotEnabled && !override) {
+    _pwmReason[channel] = XRP_ACTUATOR_REASON_DISABLED;
+    return;
+  }
+
+  if (_safetyStopped && !override && channel <= WPILIB_CH_PWM_MOTOR_4) {
+    _pwmReason[channel] = XRP_ACTUATOR_REASON_SAFETY_STOP;
+    return;
+  }
 
   if (!wpilibudp::dsWatchdogActive() && !override) {
+    _pwmReason[channel] = XRP_ACTUATOR_REASON_DS_WATCHDOG;
     return;
   }
 
   // Hard coded channel list
+  double applied = 0;
   switch (channel) {
     case WPILIB_CH_PWM_MOTOR_L:
-      _setMotorPwmValueInternal(XRP_LEFT_MOTOR_EN, XRP_LEFT_MOTOR_PH, value);
+      applied = _setMotorPwmValueInternal(XRP_LEFT_MOTOR_EN, XRP_LEFT_MOTOR_PH, value);
       break;
     case WPILIB_CH_PWM_MOTOR_R:
-      _setMotorPwmValueInternal(XRP_RIGHT_MOTOR_EN, XRP_RIGHT_MOTOR_PH, value);
+      applied = _setMotorPwmValueInternal(XRP_RIGHT_MOTOR_EN, XRP_RIGHT_MOTOR_PH, value);
       break;
     case WPILIB_CH_PWM_MOTOR_3:
-      _setMotorPwmValueInternal(XRP_MOTOR_3_EN, XRP_MOTOR_3_PH, value);
+      applied = _setMotorPwmValueInternal(XRP_MOTOR_3_EN, XRP_MOTOR_3_PH, value);
       break;
     case WPILIB_CH_PWM_MOTOR_4:
-      _setMotorPwmValueInternal(XRP_MOTOR_4_EN, XRP_MOTOR_4_PH, value);
+      applied = _setMotorPwmValueInternal(XRP_MOTOR_4_EN, XRP_MOTOR_4_PH, value);
       break;
     case WPILIB_CH_PWM_SERVO_1:
-      _setServoPwmValueInternal(0, value);
+      applied = _setServoPwmValueInternal(0, value);
       break;
     case WPILIB_CH_PWM_SERVO_2:
-      _setServoPwmValueInternal(1, value);
+      applied = _setServoPwmValueInternal(1, value);
       break;
   }
+
+  // Callers that override the command set their own reason afterwards
+  _pwmApplied[channel] = applied;
+  _pwmReason[channel] = (value > 1.0 || value < -1.0) ? XRP_ACTUATOR_REASON_CLAMPED : XRP_ACTUATOR_REASON_NONE;
+}
+
+void _pwmShutoff(uint8_t reason) {
+  for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+    _setPwmValueInternal(ch, 0, true);
+    _pwmReason[ch] = reason;
+  }
+}
+
+/**
+ * Apply the fallback behavior to channels that haven't been commanded
+ * within their timeout
+ */
+void _enforceActuatorFreshness() {
+  if (!_robotEnabled) return;
+
+  unsigned long now = millis();
+  bool rampStep = now - _lastFreshnessRampTime >= XRP_ACTUATOR_RAMP_STEP_MS;
+  if (rampStep) {
+    _lastFreshnessRampTime = now;
+  }
+
+  for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+    if (_pwmTimeoutMs[ch] == 0 || _pwmClaimed[ch]) continue;
+
+    unsigned long age = now - _pwmLastUpdateTime[ch];
+    if (age <= _pwmTimeoutMs[ch]) continue;
+
+    bool wasStale = _pwmStale[ch];
+    if (!wasStale) {
+      Serial.printf("[XRP] Channel %d stale (no update for %lu ms)\n", ch, age);
+      eventsPost(XRP_EVENT_ACTUATOR_STALE, ch);
+      _pwmStale[ch] = true;
+    }
+
+    switch (_pwmFallback[ch]) {
+      case XRP_ACTUATOR_FALLBACK_ZERO:
+      default:
+        // Anything we don't recognise gets the safest fallback
+        if (!wasStale) {
+          _setPwmValueInternal(ch, 0, true);
+          _pwmReason[ch] = XRP_ACTUATOR_REASON_STALE;
+        }
+        break;
+      case XRP_ACTUATOR_FALLBACK_RAMP: {
+        if (!rampStep) break;
+
+        unsigned long rampElapsed = age - _pwmTimeoutMs[ch];
+        double scale = 0;
+        if (rampElapsed < _pwmRampMs[ch]) {
+          scale = 1.0 - ((double)rampElapsed / _pwmRampMs[ch]);
+        }
+        if (scale == 0) {
+          // Stopping is always allowed
+          _setPwmValueInternal(ch, 0, true);
+          _pwmReason[ch] = XRP_ACTUATOR_REASON_STALE;
+          break;
+        }
+
+        // The proximity stop owns the drive motors while it's active
+        if (_proximityStopActive && (ch == WPILIB_CH_PWM_MOTOR_L || ch == WPILIB_CH_PWM_MOTOR_R)) break;
+
+        // No override, so a safety stop keeps the motor stopped
+        _setPwmValueInternal(ch, _pwmLastValue[ch] * scale, false);
+        if (_pwmReason[ch] <= XRP_ACTUATOR_REASON_CLAMPED) {
+          _pwmReason[ch] = XRP_ACTUATOR_REASON_STALE;
+        }
+      } break;
+      case XRP_ACTUATOR_FALLBACK_HOLD:
+        _pwmReason[ch] = XRP_ACTUATOR_REASON_STALE;
+        break;
+    }
+  }
+}
+
+void robotStopMotors() {
+  for (int ch = WPILIB_CH_PWM_MOTOR_L; ch <= WPILIB_CH_PWM_MOTOR_4; ch++) {
+    _setPwmValueInternal(ch, 0, true);
+    _pwmReason[ch] = XRP_ACTUATOR_REASON_SAFETY_STOP;
+  }
+}
+
+bool robotAtRest() {
+  if (_robotEnabled) {
+    for (int ch = WPILIB_CH_PWM_MOTOR_L; ch <= WPILIB_CH_PWM_MOTOR_4; ch++) {
+      if (_pwmApplied[ch] != 0) return false;
+    }
+  }
+  return millis() - _encoderLastMoveTime >= XRP_AT_REST_MS;
+}
+
+const uint8_t _motorEnablePins[] = {
+  XRP_LEFT_MOTOR_EN, XRP_RIGHT_MOTOR_EN, XRP_MOTOR_3_EN, XRP_MOTOR_4_EN
+};
+
+void robotCutMotorOutputs() {
+  for (uint8_t pin : _motorEnablePins) {
+    gpio_put(pin, 0);
+    gpio_set_dir(pin, GPIO_OUT);
+    gpio_set_function(pin, GPIO_FUNC_SIO);
+  }
+}
+
+void robotRestoreMotorOutputs() {
+  for (uint8_t pin : _motorEnablePins) {
+    gpio_set_function(pin, GPIO_FUNC_PWM);
+  }
 }
 
-void _pwmShutoff() {
-  _setPwmValueInternal(0, 0, true);
-  _setPwmValueInternal(1, 0, true);
-  _setPwmValueInternal(2, 0, true);
-  _setPwmValueInternal(3, 0, true);
-  _setPwmValueInternal(4, 0, true);
-  _setPwmValueInternal(5, 0, true);
+void robotSafetyStop(uint8_t cause) {
+  if (!_safetyStopped) {
+    Serial.printf("[XRP] Safety stop (cause 0x%02x). Disable and re-enable to resume\n", cause);
+    eventsPost(XRP_EVENT_SAFETY_STOP, cause);
+  }
+  _safetyStopped = true;
+  robotStopMotors();
+}
+
+bool robotSafetyStopped() {
+  return _safetyStopped;
 }
 
 void robotInit() {
@@ -236,16 +469,119 @@ bool robotInitialized() {
 }
 
 // Return true if this actually ran
+// Drive motors that the proximity stop is allowed to write. Stale ones
+// belong to their timeout fallback, claimed ones to the firmware
+bool _driveChannelWritable(int ch) {
+  return !_pwmClaimed[ch] && !_pwmStale[ch];
+}
+
+/**
+ * Write the drive motors with any forward motion removed.
+ *
+ * With the right motor inverted (the default, as in WPILib's
+ * XRPDrivetrain), driving forward shows up here as a positive left and a
+ * negative right value
+ */
+void _writeDriveLimited() {
+  double left = _pwmLastValue[WPILIB_CH_PWM_MOTOR_L];
+  double right = _pwmLastValue[WPILIB_CH_PWM_MOTOR_R];
+  if (_driveRightInverted) {
+    right = -right;
+  }
+  double forward = (left + right) / 2.0;
+  double turn = (left - right) / 2.0;
+
+  bool limited = forward > 0;
+  if (limited) {
+    forward = 0;
+  }
+
+  double newRight = forward - turn;
+  if (_driveRightInverted) {
+    newRight = -newRight;
+  }
+
+  if (_driveChannelWritable(WPILIB_CH_PWM_MOTOR_L)) {
+    _setPwmValueInternal(WPILIB_CH_PWM_MOTOR_L, forward + turn, false);
+  }
+  if (_driveChannelWritable(WPILIB_CH_PWM_MOTOR_R)) {
+    _setPwmValueInternal(WPILIB_CH_PWM_MOTOR_R, newRight, false);
+  }
+
+  // Only when the write went through. Otherwise the block is the reason
+  for (int ch = WPILIB_CH_PWM_MOTOR_L; ch <= WPILIB_CH_PWM_MOTOR_R; ch++) {
+    if (limited && _driveChannelWritable(ch) && _pwmReason[ch] <= XRP_ACTUATOR_REASON_CLAMPED) {
+      _pwmReason[ch] = XRP_ACTUATOR_REASON_PROXIMITY_STOP;
+    }
+  }
+}
+
+void _enforceProximityStop() {
+  if (_proximityStopMm == 0 && !_proximityStopActive) return;
+
+  float distMm = _rangefinderDistMetres * 1000.0f;
+  bool blocked;
+  if (_proximityStopMm == 0 || !_rangefinderValid) {
+    blocked = false;
+  }
+  else if (_proximityStopActive) {
+    blocked = distMm < _proximityStopMm + PROXIMITY_STOP_HYSTERESIS_MM;
+  }
+  else {
+    blocked = distMm < _proximityStopMm;
+  }
+
+  if (blocked && !_proximityStopActive) {
+    Serial.printf("[XRP] Obstacle at %.0f mm. Blocking forward drive\n", distMm);
+    eventsPost(XRP_EVENT_PROXIMITY_STOP, distMm / 10 > 255 ? 255 : (uint8_t)(distMm / 10));
+  }
+  else if (!blocked && _proximityStopActive) {
+    Serial.println("[XRP] Obstacle cleared");
+    // Put back what the host asked for
+    for (int ch = WPILIB_CH_PWM_MOTOR_L; ch <= WPILIB_CH_PWM_MOTOR_R; ch++) {
+      if (_driveChannelWritable(ch)) {
+        _setPwmValueInternal(ch, _pwmLastValue[ch], false);
+      }
+    }
+  }
+  _proximityStopActive = blocked;
+
+  if (_proximityStopActive) {
+    _writeDriveLimited();
+  }
+}
+
+// No point sending IMU values faster than the IMU makes new ones
+unsigned long _telemetryPeriodMs() {
+  int odrHz = imuGetOdrHz();
+  if (odrHz > 0 && 1000 / odrHz > XRP_TELEMETRY_PERIOD_MS) {
+    return 1000 / odrHz;
+  }
+  return XRP_TELEMETRY_PERIOD_MS;
+}
+
 uint8_t robotPeriodic() {
   uint8_t ret = 0;
 
   // Kill PWM if the watchdog is dead
   // We want this to run as quickly as possible
   if (!wpilibudp::dsWatchdogActive()) {
-    _pwmShutoff();
+    _pwmShutoff(XRP_ACTUATOR_REASON_DS_WATCHDOG);
+  }
+  else {
+    _enforceActuatorFreshness();
+    _enforceProximityStop();
   }
 
-  if (millis() - _lastRobotPeriodicCall < 50) return ret;
+  // Follow the host's loop once we've locked onto it, otherwise our own clock
+  unsigned long nowUs = micros();
+  if (telemetrySyncLocked() && wpilibudp::negotiatedProtocolVersion() >= 1) {
+    if (!telemetrySyncDue(nowUs)) return ret;
+    telemetrySyncMarkSent(nowUs);
+  }
+  else if (millis() - _lastRobotPeriodicCall < _telemetryPeriodMs()) {
+    return ret;
+  }
 
   // Just set the flag if we made it past the time check
   ret |= XRP_DATA_GENERAL;
@@ -275,7 +611,12 @@ bool isUserButtonPressed() {
 void robotSetEnabled(bool enabled) {
   // Prevent motors from starting with arbitrary values when enabling
   if (!_robotEnabled && enabled) {
-    _pwmShutoff();
+    _pwmShutoff(XRP_ACTUATOR_REASON_NONE);
+
+    if (_safetyStopped) {
+      Serial.println("[XRP] Clearing safety stop");
+      _safetyStopped = false;
+    }
   }
 
   bool prevEnabledValue = _robotEnabled;
@@ -283,63 +624,228 @@ void robotSetEnabled(bool enabled) {
 
   if (prevEnabledValue && !enabled) {
     Serial.println("[XRP] Disabling");
-    _pwmShutoff();
+    _pwmShutoff(XRP_ACTUATOR_REASON_DISABLED);
+    eventsPost(XRP_EVENT_DISABLED);
   }
   else if (!prevEnabledValue && enabled) {
     Serial.println("[XRP] Enabling");
+    eventsPost(XRP_EVENT_ENABLED);
   }
 }
 
+bool robotEnabled() {
+  return _robotEnabled;
+}
+
 void configureEncoder(int deviceId, int chA, int chB) {
+  if (deviceId < 0 || deviceId >= XRP_MAX_ENCODER_DEVICES) {
+    Serial.printf("[ERR] Invalid encoder device %d\n", deviceId);
+    return;
+  }
+
+  int nativeIdx = -1;
   if (chA == WPILIB_ENCODER_L_CH_A && chB == WPILIB_ENCODER_L_CH_B) {
-    _encoderWPILibChannelToNativeMap[deviceId] = ENC_SM_IDX_MOTOR_L;
+    nativeIdx = ENC_SM_IDX_MOTOR_L;
   }
   else if (chA == WPILIB_ENCODER_R_CH_A && chB == WPILIB_ENCODER_R_CH_B) {
-    _encoderWPILibChannelToNativeMap[deviceId] = ENC_SM_IDX_MOTOR_R;
+    nativeIdx = ENC_SM_IDX_MOTOR_R;
   }
   else if (chA == WPILIB_ENCODER_3_CH_A && chB == WPILIB_ENCODER_3_CH_B) {
-    _encoderWPILibChannelToNativeMap[deviceId] = ENC_SM_IDX_MOTOR_3;
+    nativeIdx = ENC_SM_IDX_MOTOR_3;
   }
   else if (chA == WPILIB_ENCODER_4_CH_A && chB == WPILIB_ENCODER_4_CH_B) {
-    _encoderWPILibChannelToNativeMap[deviceId] = ENC_SM_IDX_MOTOR_4;
+    nativeIdx = ENC_SM_IDX_MOTOR_4;
   }
   else {
     Serial.printf("[ERR] Invalid encoder pin mapping %d,%d\n", chA, chB);
+    return;
   }
+
+  int prevIdx = _encoderWPILibChannelToNative[deviceId];
+  if (prevIdx == -1) {
+    _numConfiguredEncoders++;
+  }
+  _encoderWPILibChannelToNative[deviceId] = nativeIdx;
+
+  // The left motor encoder is mounted mirrored, so flip it by default so that
+  // forward motion reads positive. The host can override with setEncoderReversed().
+  // Hosts resend the config on reconnect, so keep whatever direction they set
+  // unless the device has moved to a different encoder
+  if (prevIdx != nativeIdx) {
+    _encoderWPILibReversed[deviceId] = (nativeIdx == ENC_SM_IDX_MOTOR_L);
+  }
+
+  Serial.printf("[ENC] Device %d -> encoder %d\n", deviceId, nativeIdx);
+}
+
+void setEncoderReversed(int deviceId, bool reversed) {
+  if (deviceId < 0 || deviceId >= XRP_MAX_ENCODER_DEVICES) {
+    return;
+  }
+  _encoderWPILibReversed[deviceId] = reversed;
+}
+
+bool encodersConfigured() {
+  return _numConfiguredEncoders > 0;
 }
 
-// TODO this can get removed at some point since we'll ALWAYS report all values
 int readEncoder(int deviceId) {
-  if (_encoderWPILibChannelToNativeMap.count(deviceId) > 0) {
-    return _encoderValues[_encoderWPILibChannelToNativeMap[deviceId]];
+  if (deviceId < 0 || deviceId >= XRP_MAX_ENCODER_DEVICES) {
+    return 0;
+  }
+
+  int nativeIdx = _encoderWPILibChannelToNative[deviceId];
+  if (nativeIdx == -1) {
+    return 0;
   }
-  return 0;
+
+  int64_t value = readEncoderRaw(nativeIdx);
+  if (_encoderWPILibReversed[deviceId]) {
+    value = -value;
+  }
+
+  // Hosts get the low 32 bits and handle wrapping on their end
+  return (int32_t)value;
 }
 
-int readEncoderRaw(int rawDeviceId) {
-  return _encoderValues[rawDeviceId];
+int64_t readEncoderRaw(int rawDeviceId) {
+  return _encoderAccum[rawDeviceId] - _encoderOffsets[rawDeviceId];
 }
 
+int64_t sampleEncoderRaw(int rawDeviceId) {
+  if (rawDeviceId < 0 || rawDeviceId >= 4) return 0;
+  _updateEncoderInternal(rawDeviceId);
+  return readEncoderRaw(rawDeviceId);
+}
+
+/**
+ * Reset an encoder to 0.
+ *
+ * The state machine keeps counting; we just take a fresh reading and move
+ * the zero point to it, so no counts in flight are lost.
+ */
 void resetEncoder(int deviceId) {
-  if (_encoderWPILibChannelToNativeMap.count(deviceId) > 0) {
-    int idx = _encoderWPILibChannelToNativeMap[deviceId];
-    PIO _pio = _encoderPioInstance[idx];
-    uint _smIdx = _encoderStateMachineIdx[idx];
-    pio_sm_exec(_pio, _smIdx, pio_encode_set(pio_x, 0));
+  if (deviceId < 0 || deviceId >= XRP_MAX_ENCODER_DEVICES) {
+    return;
+  }
+
+  int idx = _encoderWPILibChannelToNative[deviceId];
+  if (idx != -1) {
+    _updateEncoderInternal(idx);
+    _encoderOffsets[idx] = _encoderAccum[idx];
   }
 }
 
 std::vector<std::pair<int,int> > getActiveEncoderValues() {
   std::vector<std::pair<int,int> > ret;
-  for (auto encData : _encoderWPILibChannelToNativeMap) {
-    int wpilibDevice = encData.first;
-    int nativeChannel = encData.second;
-    ret.push_back(std::make_pair(wpilibDevice, _encoderValues[nativeChannel]));
+  ret.reserve(_numConfiguredEncoders);
+  for (int i = 0; i < XRP_MAX_ENCODER_DEVICES; i++) {
+    if (_encoderWPILibChannelToNative[i] != -1) {
+      ret.push_back(std::make_pair(i, readEncoder(i)));
+    }
   }
   return ret;
 }
 
 void setPwmValue(int wpilibChannel, double value) {
+  if (wpilibChannel >= 0 && wpilibChannel < XRP_NUM_PWM_CHANNELS) {
+    _pwmLastUpdateTime[wpilibChannel] = millis();
+    _pwmLastValue[wpilibChannel] = value;
+    _pwmStale[wpilibChannel] = false;
+
+    if (_pwmClaimed[wpilibChannel]) return;
+  }
+
+  if (_proximityStopActive &&
+      (wpilibChannel == WPILIB_CH_PWM_MOTOR_L || wpilibChannel == WPILIB_CH_PWM_MOTOR_R)) {
+    _writeDriveLimited();
+    return;
+  }
+
+  _setPwmValueInternal(wpilibChannel, value, false);
+}
+
+void setPwmValues(const double values[XRP_NUM_PWM_CHANNELS], uint8_t mask) {
+  unsigned long now = millis();
+  for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+    if (!(mask & (1 << ch))) continue;
+    _pwmLastUpdateTime[ch] = now;
+    _pwmLastValue[ch] = values[ch];
+    _pwmStale[ch] = false;
+  }
+
+  // One check for the whole batch, so either every output changes or none do
+  if (!_robotEnabled || !wpilibudp::dsWatchdogActive()) {
+    uint8_t reason = _robotEnabled ? XRP_ACTUATOR_REASON_DS_WATCHDOG : XRP_ACTUATOR_REASON_DISABLED;
+    for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+      if (mask & (1 << ch)) _pwmReason[ch] = reason;
+    }
+    return;
+  }
+
+  for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+    if (!(mask & (1 << ch)) || _pwmClaimed[ch]) continue;
+    if (_safetyStopped && ch <= WPILIB_CH_PWM_MOTOR_4) {
+      _pwmReason[ch] = XRP_ACTUATOR_REASON_SAFETY_STOP;
+      continue;
+    }
+    if (_proximityStopActive && (ch == WPILIB_CH_PWM_MOTOR_L || ch == WPILIB_CH_PWM_MOTOR_R)) continue;
+    _setPwmValueInternal(ch, values[ch], true);
+  }
+
+  if (_proximityStopActive && (mask & ((1 << WPILIB_CH_PWM_MOTOR_L) | (1 << WPILIB_CH_PWM_MOTOR_R)))) {
+    _writeDriveLimited();
+  }
+}
+
+void setActuatorTimeout(int wpilibChannel, unsigned long timeoutMs, uint8_t fallback, unsigned long rampMs) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return;
+
+  if (fallback != XRP_ACTUATOR_FALLBACK_ZERO && fallback != XRP_ACTUATOR_FALLBACK_HOLD &&
+      fallback != XRP_ACTUATOR_FALLBACK_RAMP) {
+    Serial.printf("[ERR] Invalid actuator fallback %u for channel %d\n", fallback, wpilibChannel);
+    return;
+  }
+
+  _pwmTimeoutMs[wpilibChannel] = timeoutMs;
+  _pwmFallback[wpilibChannel] = fallback;
+  _pwmRampMs[wpilibChannel] = rampMs;
+
+  // Start the clock from now, rather than from whenever the last command was
+  _pwmLastUpdateTime[wpilibChannel] = millis();
+  _pwmStale[wpilibChannel] = false;
+
+  Serial.printf("[XRP] Channel %d timeout %lu ms, fallback %u, ramp %lu ms\n", wpilibChannel, timeoutMs, fallback, rampMs);
+}
+
+bool actuatorStale(int wpilibChannel) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return false;
+  return _pwmStale[wpilibChannel];
+}
+
+float actuatorOutput(int wpilibChannel) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return 0;
+
+  // Servos are 0 to 1 on the wire
+  if (wpilibChannel >= WPILIB_CH_PWM_SERVO_1) {
+    return (_pwmApplied[wpilibChannel] + 1.0f) / 2.0f;
+  }
+  return _pwmApplied[wpilibChannel];
+}
+
+uint8_t actuatorOverrideReason(int wpilibChannel) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return XRP_ACTUATOR_REASON_NONE;
+  return _pwmReason[wpilibChannel];
+}
+
+void robotClaimChannel(int wpilibChannel, bool claimed) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return;
+  _pwmClaimed[wpilibChannel] = claimed;
+}
+
+void robotSetClaimedOutput(int wpilibChannel, double value) {
+  if (wpilibChannel < 0 || wpilibChannel >= XRP_NUM_PWM_CHANNELS) return;
+  if (!_pwmClaimed[wpilibChannel]) return;
   _setPwmValueInternal(wpilibChannel, value, false);
 }
 
@@ -350,6 +856,37 @@ void setDigitalOutput(int channel, bool value) {
   }
 }
 
+/**
+ * Check if an analog input is being driven by something.
+ *
+ * We alternate the internal pull up and pull down and see if the reading
+ * follows. analogRead() resets the pulls, so this talks to the ADC directly.
+ */
+bool _analogPinDriven(uint8_t pin) {
+  // Make sure the ADC is set up
+  analogRead(pin);
+  adc_select_input(pin - 26);
+
+  gpio_set_pulls(pin, true, false);
+  delayMicroseconds(REFLECT_PROBE_SETTLE_US);
+  int pulledUp = adc_read();
+
+  gpio_set_pulls(pin, false, true);
+  delayMicroseconds(REFLECT_PROBE_SETTLE_US);
+  int pulledDown = adc_read();
+
+  gpio_disable_pulls(pin);
+
+  Serial.printf("[XRP] Analog pin %u probe: up(%d) down(%d)\n", pin, pulledUp, pulledDown);
+  return abs(pulledUp - pulledDown) < REFLECT_PROBE_FLOAT_DELTA;
+}
+
+bool reflectanceProbe() {
+  analogReadResolution(12);
+
+  return _analogPinDriven(REFLECT_LEFT_PIN) || _analogPinDriven(REFLECT_RIGHT_PIN);
+}
+
 void reflectanceInit() {
   analogReadResolution(12);
 
@@ -384,11 +921,55 @@ float getReflectanceRight5V() {
   return _readAnalogPinScaled(REFLECT_RIGHT_PIN) * 5.0f;
 }
 
+/**
+ * Check for an ultrasonic rangefinder by triggering it and waiting for the
+ * start of an echo pulse.
+ */
+bool rangefinderProbe() {
+  pinMode(ULTRASONIC_TRIG_PIN, OUTPUT);
+  digitalWrite(ULTRASONIC_TRIG_PIN, LOW);
+
+  // Hold the echo line low so that a floating pin doesn't look like a pulse
+  pinMode(ULTRASONIC_ECHO_PIN, INPUT_PULLDOWN);
+
+  bool detected = false;
+  for (int i = 0; i < ULTRASONIC_PROBE_ATTEMPTS && !detected; i++) {
+    // A stuck-high echo line isn't a working sensor
+    if (digitalRead(ULTRASONIC_ECHO_PIN) == 1) {
+      delay(ULTRASONIC_ECHO_START_TIMEOUT_US / 1000);
+      continue;
+    }
+
+    digitalWrite(ULTRASONIC_TRIG_PIN, HIGH);
+    delayMicroseconds(10);
+    digitalWrite(ULTRASONIC_TRIG_PIN, LOW);
+
+    unsigned long t1 = micros();
+    while (micros() - t1 < ULTRASONIC_ECHO_START_TIMEOUT_US) {
+      if (digitalRead(ULTRASONIC_ECHO_PIN) == 1) {
+        detected = true;
+        break;
+      }
+    }
+
+    // Let any echo finish before the next attempt
+    delay(ULTRASONIC_ECHO_START_TIMEOUT_US / 1000);
+  }
+
+  pinMode(ULTRASONIC_ECHO_PIN, INPUT);
+  return detected;
+}
+
 void rangefinderInit() {
   pinMode(ULTRASONIC_TRIG_PIN, OUTPUT); // Trigger Pin
   digitalWrite(ULTRASONIC_TRIG_PIN, LOW);
 
   pinMode(ULTRASONIC_ECHO_PIN, INPUT); // Echo pin
+
+  for (int i = 0; i < XRP_RANGEFINDER_FILTER_SIZE; i++) {
+    _rangefinderSamples[i] = RANGEFINDER_NO_ECHO;
+  }
+  _rangefinderRateWindowStart = millis();
   _rangefinderInitialized = true;
 }
 
@@ -400,11 +981,76 @@ float getRangefinderDistance5V() {
   return (_rangefinderDistMetres / RANGEFINDER_MAX_DIST_M) * 5.0f;
 }
 
+float getRangefinderDistanceMetres() {
+  return _rangefinderDistMetres;
+}
+
+bool rangefinderValid() {
+  return _rangefinderValid;
+}
+
+float rangefinderSampleRateHz() {
+  return _rangefinderRateHz;
+}
+
+void _rangefinderAddSample(float distMetres) {
+  _rangefinderSamples[_rangefinderSampleIdx] = distMetres;
+  _rangefinderSampleIdx = (_rangefinderSampleIdx + 1) % XRP_RANGEFINDER_FILTER_SIZE;
+
+  // Median of the good measurements, which throws out single-sample spikes
+  float sorted[XRP_RANGEFINDER_FILTER_SIZE];
+  int numValid = 0;
+  for (int i = 0; i < XRP_RANGEFINDER_FILTER_SIZE; i++) {
+    float sample = _rangefinderSamples[i];
+    if (sample < 0) continue;
+
+    int j = numValid++;
+    while (j > 0 && sorted[j - 1] > sample) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = sample;
+  }
+
+  _rangefinderValid = numValid >= XRP_RANGEFINDER_MIN_VALID;
+  if (_rangefinderValid) {
+    _rangefinderDistMetres = sorted[numValid / 2];
+  }
+  else {
+    // Nothing in range (or no sensor). Same as the legacy behavior
+    _rangefinderDistMetres = RANGEFINDER_MAX_DIST_M;
+  }
+
+  _rangefinderRateWindowCount++;
+}
+
 void rangefinderPollForData() {
   uint32_t bits = 0;
-  if (rp2040.fifo.pop_nb(&bits)) {
-    memcpy(&_rangefinderDistMetres, &bits, sizeof(_rangefinderDistMetres));
+  while (rp2040.fifo.pop_nb(&bits)) {
+    float distMetres;
+    memcpy(&distMetres, &bits, sizeof(distMetres));
+    _rangefinderAddSample(distMetres);
   }
+
+  unsigned long now = millis();
+  if (now - _rangefinderRateWindowStart >= 1000) {
+    _rangefinderRateHz = (_rangefinderRateWindowCount * 1000.0f) / (now - _rangefinderRateWindowStart);
+    _rangefinderRateWindowCount = 0;
+    _rangefinderRateWindowStart = now;
+  }
+}
+
+void setProximityStop(uint16_t distanceMm) {
+  _proximityStopMm = distanceMm;
+  Serial.printf("[XRP] Proximity stop %s (%u mm)\n", distanceMm ? "on" : "off", distanceMm);
+}
+
+void setDriveRightInverted(bool inverted) {
+  _driveRightInverted = inverted;
+}
+
+bool proximityStopActive() {
+  return _proximityStopActive;
 }
 
 void rangefinderPeriodic() {
@@ -423,11 +1069,23 @@ void rangefinderPeriodic() {
   delayMicroseconds(10);
   digitalWrite(ULTRASONIC_TRIG_PIN, LOW);
 
-  // wait for pulse on the echo pin
-  while (digitalRead(ULTRASONIC_ECHO_PIN) == 0);
+  // wait for pulse on the echo pin. Give up if the sensor never answers
+  // (e.g. it was unplugged) so that we don't hang this core
+  t1 = micros();
+  while (digitalRead(ULTRASONIC_ECHO_PIN) == 0) {
+    livenessBeat();
+    if (micros() - t1 > ULTRASONIC_ECHO_START_TIMEOUT_US) {
+      distMetres = RANGEFINDER_NO_ECHO;
+      uint32_t bits = 0;
+      memcpy(&bits, &distMetres, sizeof(bits));
+      rp2040.fifo.push_nb(bits);
+      return;
+    }
+  }
 
   t1 = micros();
   while (digitalRead(ULTRASONIC_ECHO_PIN) == 1) {
+    livenessBeat();
     if (micros() - t1 > ULTRASONIC_MAX_PULSE_WIDTH) {
       break;
     }
@@ -438,7 +1096,7 @@ void rangefinderPeriodic() {
   distCM = pulseWidth / 58.0;
 
   if (pulseWidth > ULTRASONIC_MAX_PULSE_WIDTH) {
-    distMetres = RANGEFINDER_MAX_DIST_M;
+    distMetres = RANGEFINDER_NO_ECHO;
   }
   else {
     distMetres = distCM / 100.0f;
@@ -0,0 +1,224 @@
+#include "sysid.h"
+#include "robot.h"
+#include "wpilibudp.h"
+
+#include <Arduino.h>
+#include <stdlib.h>
+
+namespace xrp {
+
+SysIdState _sysidState = SYSID_IDLE;
+
+int _sysidChannel = -1;
+uint8_t _sysidMode = 0;
+float _sysidValue = 0;
+uint32_t _sysidDurationUs = 0;
+
+unsigned long _sysidStartUs = 0;
+unsigned long _sysidNextStepUs = 0;
+unsigned long _sysidStepCount = 0;
+unsigned long _sysidOverruns = 0;
+int _sysidDecimation = 1;
+
+// Recent positions for the velocity estimate
+int32_t _sysidPosHistory[XRP_SYSID_VELOCITY_WINDOW + 1];
+uint32_t _sysidTimeHistory[XRP_SYSID_VELOCITY_WINDOW + 1];
+int _sysidHistoryIdx = 0;
+
+// Allocated by the first test, so boards that never run one don't pay for it
+SysIdSample* _sysidSamples = nullptr;
+int _sysidNumSamples = 0;
+
+// Streaming
+bool _sysidStreaming = false;
+int _sysidStreamIdx = 0;
+unsigned long _sysidLastStreamUs = 0;
+
+void _sysidFinish(SysIdState result) {
+  robotSetClaimedOutput(_sysidChannel, 0);
+  robotClaimChannel(_sysidChannel, false);
+  _sysidState = result;
+
+  Serial.printf("[SYSID] Test %s. %d samples, %lu steps, %lu overruns\n",
+      result == SYSID_DONE ? "complete" : "aborted", _sysidNumSamples, _sysidStepCount, _sysidOverruns);
+
+  // Whatever we got is worth sending
+  sysidRequestData(0);
+}
+
+bool sysidStart(int motorChannel, uint8_t mode, float value, uint16_t durationMs) {
+  if (_sysidState == SYSID_RUNNING) {
+    Serial.println("[SYSID] Test already running");
+    return false;
+  }
+
+  if (motorChannel < WPILIB_CH_PWM_MOTOR_L || motorChannel > WPILIB_CH_PWM_MOTOR_4 ||
+      (mode != XRP_SYSID_MODE_QUASISTATIC && mode != XRP_SYSID_MODE_DYNAMIC) ||
+      durationMs == 0 || durationMs > XRP_SYSID_MAX_DURATION_MS) {
+    Serial.println("[SYSID] Invalid test spec");
+    return false;
+  }
+
+  // A NaN would sail through the output clamp and straight to the motor
+  if (!isfinite(value)) {
+    Serial.println("[SYSID] Invalid test value");
+    return false;
+  }
+
+  if (!robotEnabled()) {
+    Serial.println("[SYSID] Robot must be enabled to run a test");
+    return false;
+  }
+
+  if (_sysidSamples == nullptr) {
+    _sysidSamples = (SysIdSample*)malloc(sizeof(SysIdSample) * XRP_SYSID_MAX_SAMPLES);
+    if (_sysidSamples == nullptr) {
+      Serial.println("[SYSID] Not enough memory for the sample buffer");
+      return false;
+    }
+  }
+
+  _sysidChannel = motorChannel;
+  _sysidMode = mode;
+  _sysidValue = value;
+  _sysidDurationUs = (uint32_t)durationMs * 1000;
+
+  unsigned long totalSteps = _sysidDurationUs / XRP_SYSID_CONTROL_PERIOD_US;
+  _sysidDecimation = (totalSteps + XRP_SYSID_MAX_SAMPLES - 1) / XRP_SYSID_MAX_SAMPLES;
+  if (_sysidDecimation < 1) _sysidDecimation = 1;
+
+  _sysidNumSamples = 0;
+  _sysidStepCount = 0;
+  _sysidOverruns = 0;
+  _sysidHistoryIdx = 0;
+  _sysidStreaming = false;
+
+  // Seed the velocity history with where we are now
+  int32_t pos = (int32_t)sampleEncoderRaw(_sysidChannel);
+  for (int i = 0; i <= XRP_SYSID_VELOCITY_WINDOW; i++) {
+    _sysidPosHistory[i] = pos;
+    _sysidTimeHistory[i] = 0;
+  }
+
+  robotClaimChannel(_sysidChannel, true);
+  _sysidStartUs = micros();
+  _sysidNextStepUs = _sysidStartUs;
+  _sysidState = SYSID_RUNNING;
+
+  Serial.printf("[SYSID] %s test on motor %d (value %.3f) for %u ms, recording every %d ms\n",
+      mode == XRP_SYSID_MODE_QUASISTATIC ? "Quasistatic" : "Dynamic",
+      motorChannel, value, durationMs, _sysidDecimation * XRP_SYSID_CONTROL_PERIOD_US / 1000);
+  return true;
+}
+
+void sysidAbort() {
+  if (_sysidState != SYSID_RUNNING) return;
+  _sysidFinish(SYSID_ABORTED);
+}
+
+void sysidPeriodic() {
+  if (_sysidState != SYSID_RUNNING) return;
+
+  if (!robotEnabled() || !wpilibudp::dsWatchdogActive() || robotSafetyStopped()) {
+    Serial.println("[SYSID] Robot stopped during test");
+    _sysidFinish(SYSID_ABORTED);
+    return;
+  }
+
+  unsigned long now = micros();
+  if ((long)(now - _sysidNextStepUs) < 0) return;
+
+  // Don't try to catch up on steps we missed. Each sample has its own time
+  _sysidNextStepUs += XRP_SYSID_CONTROL_PERIOD_US;
+  if ((long)(now - _sysidNextStepUs) >= 0) {
+    _sysidOverruns++;
+    _sysidNextStepUs = now + XRP_SYSID_CONTROL_PERIOD_US;
+  }
+
+  uint32_t t = now - _sysidStartUs;
+  if (t >= _sysidDurationUs) {
+    _sysidFinish(SYSID_DONE);
+    return;
+  }
+
+  double output = _sysidValue;
+  if (_sysidMode == XRP_SYSID_MODE_QUASISTATIC) {
+    output = _sysidValue * (t / 1000000.0);
+  }
+  if (output > 1.0) output = 1.0;
+  if (output < -1.0) output = -1.0;
+  robotSetClaimedOutput(_sysidChannel, output);
+
+  int32_t pos = (int32_t)sampleEncoderRaw(_sysidChannel);
+
+  // Oldest entry in the ring is the one we're about to overwrite
+  int oldest = (_sysidHistoryIdx + 1) % (XRP_SYSID_VELOCITY_WINDOW + 1);
+  _sysidHistoryIdx = oldest;
+  uint32_t dtUs = t - _sysidTimeHistory[oldest];
+  float velocity = dtUs == 0 ? 0 : (pos - _sysidPosHistory[oldest]) * 1e6f / dtUs;
+  _sysidPosHistory[oldest] = pos;
+  _sysidTimeHistory[oldest] = t;
+
+  if (_sysidStepCount % _sysidDecimation == 0 && _sysidNumSamples < XRP_SYSID_MAX_SAMPLES) {
+    SysIdSample& s = _sysidSamples[_sysidNumSamples++];
+    s.timeUs = t;
+    s.output = actuatorOutput(_sysidChannel);
+    s.position = pos;
+    s.velocity = velocity;
+  }
+  _sysidStepCount++;
+}
+
+SysIdState sysidState() {
+  return _sysidState;
+}
+
+bool sysidRunning() {
+  return _sysidState == SYSID_RUNNING;
+}
+
+int sysidSampleCount() {
+  return _sysidNumSamples;
+}
+
+uint32_t sysidSamplePeriodUs() {
+  return _sysidDecimation * XRP_SYSID_CONTROL_PERIOD_US;
+}
+
+unsigned long sysidOverrunCount() {
+  return _sysidOverruns;
+}
+
+void sysidRequestData(uint16_t fromIndex) {
+  if (_sysidState == SYSID_RUNNING || _sysidState == SYSID_IDLE) return;
+  if (fromIndex >= _sysidNumSamples) return;
+
+  _sysidStreamIdx = fromIndex;
+  _sysidStreaming = true;
+}
+
+bool sysidStreamDue() {
+  if (!_sysidStreaming) return false;
+  return micros() - _sysidLastStreamUs >= XRP_SYSID_STREAM_INTERVAL_US;
+}
+
+int sysidNextChunk(SysIdSample* out, int maxSamples, uint16_t* firstIndex) {
+  if (!_sysidStreaming) return 0;
+
+  int count = _sysidNumSamples - _sysidStreamIdx;
+  if (count > maxSamples) count = maxSamples;
+
+  *firstIndex = _sysidStreamIdx;
+  for (int i = 0; i < count; i++) {
+    out[i] = _sysidSamples[_sysidStreamIdx + i];
+  }
+  _sysidStreamIdx += count;
+  _sysidLastStreamUs = micros();
+
+  if (_sysidStreamIdx >= _sysidNumSamples) {
+    _sysidStreaming = false;
+  }
+  return count;
+}
+
+} // namespace xrp
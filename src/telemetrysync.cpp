@@ -0,0 +1,147 @@
+#include "telemetrysync.h"
+
+#include <Arduino.h>
+
+// Loop filter gains. Phase follows the error quickly, period slowly
+#define SYNC_PHASE_GAIN 0.3f
+#define SYNC_PERIOD_GAIN 0.05f
+
+namespace xrp {
+
+uint16_t _syncLeadUs = XRP_TELEMETRY_SYNC_DEFAULT_LEAD_US;
+
+bool _syncLocked = false;
+int _syncGoodIntervals = 0;
+float _syncPeriodUs = 0;
+unsigned long _syncLastArrivalUs = 0;
+bool _syncHaveArrival = false;
+unsigned long _syncNextArrivalUs = 0;
+
+// Send every Nth host period if the host runs faster than we want to send
+int _syncDecimation = 1;
+int _syncPeriodCount = 0;
+
+bool _syncSendPending = false;
+unsigned long _syncSendAtUs = 0;
+unsigned long _syncLastSendUs = 0;
+bool _syncAwaitingArrival = false;
+int32_t _syncPhaseErrorUs = 0;
+
+void _syncUnlock() {
+  if (_syncLocked) {
+    Serial.println("[TSYNC] Lost lock on host commands");
+  }
+  _syncLocked = false;
+  _syncGoodIntervals = 0;
+  _syncSendPending = false;
+}
+
+void telemetrySyncOnCommand(unsigned long nowUs) {
+  if (_syncLeadUs == 0) return;
+
+  if (_syncHaveArrival) {
+    unsigned long interval = nowUs - _syncLastArrivalUs;
+
+    // Several packets from the same host loop. The first one sets the phase
+    if (interval < XRP_TELEMETRY_SYNC_MIN_PERIOD_US) return;
+
+    if (interval > XRP_TELEMETRY_SYNC_MAX_PERIOD_US) {
+      _syncUnlock();
+      _syncPeriodUs = 0;
+    }
+    else if (_syncLocked) {
+      int32_t err = (int32_t)(nowUs - _syncNextArrivalUs);
+      if (fabsf((float)err) > _syncPeriodUs / 2) {
+        _syncUnlock();
+      }
+      else {
+        _syncPeriodUs += err * SYNC_PERIOD_GAIN;
+
+        // Where the last frame landed relative to where we wanted it
+        if (_syncAwaitingArrival) {
+          _syncPhaseErrorUs = (int32_t)(nowUs - _syncLastSendUs) - _syncLeadUs;
+          _syncAwaitingArrival = false;
+        }
+
+        // Smooth out jitter rather than jumping to each arrival
+        nowUs = _syncNextArrivalUs + (int32_t)(err * SYNC_PHASE_GAIN);
+      }
+    }
+    else if (_syncPeriodUs == 0) {
+      _syncPeriodUs = interval;
+    }
+    else {
+      if (fabsf(interval - _syncPeriodUs) < _syncPeriodUs * 0.1f) {
+        _syncGoodIntervals++;
+      }
+      else {
+        _syncGoodIntervals = 0;
+      }
+      _syncPeriodUs = (_syncPeriodUs * 0.8f) + (interval * 0.2f);
+
+      if (_syncGoodIntervals >= XRP_TELEMETRY_SYNC_LOCK_COUNT) {
+        _syncLocked = true;
+        _syncDecimation = (int)ceilf(XRP_TELEMETRY_SYNC_MIN_SEND_PERIOD_US / _syncPeriodUs);
+        _syncPeriodCount = 0;
+        _syncAwaitingArrival = false;
+        Serial.printf("[TSYNC] Locked on host commands every %lu us\n", (unsigned long)_syncPeriodUs);
+      }
+    }
+  }
+
+  _syncHaveArrival = true;
+  _syncLastArrivalUs = nowUs;
+  _syncNextArrivalUs = nowUs + (unsigned long)_syncPeriodUs;
+
+  if (_syncLocked && ++_syncPeriodCount >= _syncDecimation) {
+    _syncPeriodCount = 0;
+    _syncSendAtUs = _syncNextArrivalUs - _syncLeadUs;
+    _syncSendPending = true;
+  }
+}
+
+void telemetrySyncSetLead(uint16_t leadUs) {
+  _syncLeadUs = leadUs;
+  if (leadUs == 0) {
+    _syncUnlock();
+    _syncHaveArrival = false;
+    _syncPeriodUs = 0;
+  }
+  Serial.printf("[TSYNC] Lead set to %u us\n", leadUs);
+}
+
+uint16_t telemetrySyncLead() {
+  return _syncLeadUs;
+}
+
+bool telemetrySyncLocked() {
+  return _syncLocked;
+}
+
+bool telemetrySyncDue(unsigned long nowUs) {
+  if (!_syncLocked) return false;
+
+  // Host has gone quiet (or slowed right down)
+  if (nowUs - _syncLastArrivalUs > XRP_TELEMETRY_SYNC_MISSED_PERIODS * _syncPeriodUs) {
+    _syncUnlock();
+    return false;
+  }
+
+  return _syncSendPending && (long)(nowUs - _syncSendAtUs) >= 0;
+}
+
+void telemetrySyncMarkSent(unsigned long nowUs) {
+  _syncSendPending = false;
+  _syncLastSendUs = nowUs;
+  _syncAwaitingArrival = true;
+}
+
+unsigned long telemetrySyncPeriodUs() {
+  return (unsigned long)_syncPeriodUs;
+}
+
+int32_t telemetrySyncPhaseErrorUs() {
+  return _syncPhaseErrorUs;
+}
+
+} // namespace xrp
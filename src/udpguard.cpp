@@ -0,0 +1,103 @@
+#include "udpguard.h"
+
+#include <Arduino.h>
+
+namespace xrp {
+
+struct UdpSource {
+  uint32_t addr;
+  uint16_t port;
+  bool inUse;
+  // Tokens are kept in thousandths so that we don't need floats
+  unsigned long tokensMilli;
+  unsigned long lastRefillUs;
+  unsigned long lastSeenMs;
+};
+
+UdpSource _udpSources[XRP_UDP_GUARD_NUM_SOURCES];
+
+unsigned long _udpAcceptedCount = 0;
+unsigned long _udpNotOwnerCount = 0;
+unsigned long _udpRateLimitedCount = 0;
+
+UdpSource& _findSource(uint32_t addr, uint16_t port) {
+  int oldestIdx = 0;
+  for (int i = 0; i < XRP_UDP_GUARD_NUM_SOURCES; i++) {
+    UdpSource& src = _udpSources[i];
+    if (src.inUse && src.addr == addr && src.port == port) {
+      return src;
+    }
+
+    // Prefer empty slots, then the least recently seen source
+    if (!src.inUse) {
+      oldestIdx = i;
+    }
+    else if (_udpSources[oldestIdx].inUse && src.lastSeenMs < _udpSources[oldestIdx].lastSeenMs) {
+      oldestIdx = i;
+    }
+  }
+
+  UdpSource& src = _udpSources[oldestIdx];
+  src.addr = addr;
+  src.port = port;
+  src.inUse = true;
+  src.tokensMilli = XRP_UDP_RATE_LIMIT_BURST * 1000;
+  src.lastRefillUs = micros();
+  return src;
+}
+
+bool _takeToken(UdpSource& src) {
+  unsigned long now = micros();
+  unsigned long elapsed = now - src.lastRefillUs;
+
+  // Anything over a second fills the bucket anyway, and this keeps the
+  // math below from overflowing
+  if (elapsed > 1000000) {
+    elapsed = 1000000;
+  }
+
+  src.tokensMilli += (elapsed * XRP_UDP_RATE_LIMIT_PPS) / 1000;
+  if (src.tokensMilli > XRP_UDP_RATE_LIMIT_BURST * 1000) {
+    src.tokensMilli = XRP_UDP_RATE_LIMIT_BURST * 1000;
+  }
+  src.lastRefillUs = now;
+
+  if (src.tokensMilli < 1000) {
+    return false;
+  }
+  src.tokensMilli -= 1000;
+  return true;
+}
+
+UdpAdmitResult udpGuardCheck(uint32_t addr, uint16_t port, bool sessionActive, uint32_t ownerAddr, uint16_t ownerPort) {
+  // Cheapest check first
+  if (sessionActive && (addr != ownerAddr || port != ownerPort)) {
+    _udpNotOwnerCount++;
+    return UDP_REJECT_NOT_OWNER;
+  }
+
+  UdpSource& src = _findSource(addr, port);
+  src.lastSeenMs = millis();
+
+  if (!_takeToken(src)) {
+    _udpRateLimitedCount++;
+    return UDP_REJECT_RATE_LIMITED;
+  }
+
+  _udpAcceptedCount++;
+  return UDP_ADMIT;
+}
+
+unsigned long udpGuardAcceptedCount() {
+  return _udpAcceptedCount;
+}
+
+unsigned long udpGuardNotOwnerCount() {
+  return _udpNotOwnerCount;
+}
+
+unsigned long udpGuardRateLimitedCount() {
+  return _udpRateLimitedCount;
+}
+
+} // namespace xrp
@@ -1,8 +1,11 @@
+#include <cstring>
+
 #include "byteutils.h"
 #include "wpilibudp.h"
 #include "robot.h"
 #include "watchdog.h"
 #include "imu.h"
+#include "telemetrysync.h"
 
 // Since we might (nay, will) rollover, the fudge factor lets us deal with cases like
 // 65532, 65533, 0, 65534, 65535 by taking 0 as the new highest seq number
@@ -14,6 +17,36 @@ namespace wpilibudp {
 uint16_t currMaxSeq = 0;
 xrp::Watchdog _dsWatchdog{"status"};
 
+// Capability handshake
+bool _capabilitiesRequested = false;
+uint8_t _negotiatedProtocolVersion = 0;
+
+// Optional telemetry requested by the host. This sticks across DS watchdog
+// timeouts, like the encoder configuration
+uint16_t _telemetryOptions = 0;
+
+// Host -> XRP tags that this firmware understands
+const uint8_t _supportedTags[] = {
+  XRP_TAG_MOTOR,
+  XRP_TAG_SERVO,
+  XRP_TAG_DIO,
+  XRP_TAG_ENCODER_CONFIG,
+  XRP_TAG_ENCODER_RESET,
+  XRP_TAG_ENCODER_DIRECTION,
+  XRP_TAG_GYRO_RESET,
+  XRP_TAG_GYRO_CALIBRATE,
+  XRP_TAG_HELLO,
+  XRP_TAG_TELEMETRY_CONFIG,
+  XRP_TAG_ACTUATOR_TIMEOUT,
+  XRP_TAG_ACTUATORS,
+  XRP_TAG_MOTION_CONFIG,
+  XRP_TAG_PROXIMITY_STOP,
+  XRP_TAG_IMU_CONFIG,
+  XRP_TAG_TELEMETRY_SYNC_CONFIG,
+  XRP_TAG_SYSID_START,
+  XRP_TAG_SYSID_CONTROL
+};
+
 bool _processTaggedData(char* buffer, int start, int end) {
   // The data here is the 1 byte tag and n byte payload
   // range is [start, end) in buffer
@@ -58,6 +91,166 @@ bool _processTaggedData(char* buffer, int start, int end) {
 
       xrp::setDigitalOutput(channel, value);
     } break;
+    case XRP_TAG_ENCODER_CONFIG: {
+      // tag(1) id(1) chA(1) chB(1)
+      if (end - start < 4) {
+        return false;
+      }
+
+      int deviceId = (uint8_t)buffer[start+1];
+      int chA = (uint8_t)buffer[start+2];
+      int chB = (uint8_t)buffer[start+3];
+
+      xrp::configureEncoder(deviceId, chA, chB);
+    } break;
+    case XRP_TAG_ENCODER_RESET: {
+      // tag(1) id(1)
+      if (end - start < 2) {
+        return false;
+      }
+
+      xrp::resetEncoder((uint8_t)buffer[start+1]);
+    } break;
+    case XRP_TAG_ENCODER_DIRECTION: {
+      // tag(1) id(1) reversed(1)
+      if (end - start < 3) {
+        return false;
+      }
+
+      int deviceId = (uint8_t)buffer[start+1];
+      bool reversed = buffer[start+2] == 1;
+
+      xrp::setEncoderReversed(deviceId, reversed);
+    } break;
+    case XRP_TAG_GYRO_RESET: {
+      // tag(1) axisMask(1)
+      if (end - start < 2) {
+        return false;
+      }
+
+      xrp::imuResetAxes(buffer[start+1]);
+    } break;
+    case XRP_TAG_GYRO_CALIBRATE: {
+      // tag(1) durationMs(2)
+      if (end - start < 3) {
+        return false;
+      }
+
+      xrp::imuStartCalibration(networkToUInt16(buffer, start+1));
+    } break;
+    case XRP_TAG_HELLO: {
+      // tag(1) hostProtocolVersion(1)
+      if (end - start < 2) {
+        return false;
+      }
+
+      // Speak the older of the two versions
+      uint8_t hostVersion = buffer[start+1];
+      _negotiatedProtocolVersion = hostVersion < XRP_PROTOCOL_EXT_VERSION ? hostVersion : XRP_PROTOCOL_EXT_VERSION;
+      _capabilitiesRequested = true;
+    } break;
+    case XRP_TAG_TELEMETRY_CONFIG: {
+      // tag(1) options(2)
+      if (end - start < 3) {
+        return false;
+      }
+
+      _telemetryOptions = networkToUInt16(buffer, start+1);
+    } break;
+    case XRP_TAG_ACTUATOR_TIMEOUT: {
+      // tag(1) channel(1) timeoutMs(2) fallback(1) rampMs(2)
+      if (end - start < 7) {
+        return false;
+      }
+
+      int channel = buffer[start+1];
+      uint16_t timeoutMs = networkToUInt16(buffer, start+2);
+      uint8_t fallback = buffer[start+4];
+      uint16_t rampMs = networkToUInt16(buffer, start+5);
+
+      xrp::setActuatorTimeout(channel, timeoutMs, fallback, rampMs);
+    } break;
+    case XRP_TAG_ACTUATORS: {
+      // tag(1) mask(1) motorL(4) motorR(4) motor3(4) motor4(4) servo1(4) servo2(4)
+      if (end - start < 2 + (4 * XRP_NUM_PWM_CHANNELS)) {
+        return false;
+      }
+
+      uint8_t mask = buffer[start+1];
+      double values[XRP_NUM_PWM_CHANNELS];
+      for (int ch = 0; ch < XRP_NUM_PWM_CHANNELS; ch++) {
+        values[ch] = networkToFloat(buffer, start + 2 + (4 * ch));
+      }
+
+      // Servos come as 0 to 1, same as XRP_TAG_SERVO
+      values[WPILIB_CH_PWM_SERVO_1] = (2.0 * values[WPILIB_CH_PWM_SERVO_1]) - 1.0;
+      values[WPILIB_CH_PWM_SERVO_2] = (2.0 * values[WPILIB_CH_PWM_SERVO_2]) - 1.0;
+
+      xrp::setPwmValues(values, mask);
+    } break;
+    case XRP_TAG_MOTION_CONFIG: {
+      // tag(1) impactMg(2) tiltDeg(1) freeFallMs(2) cutoffMask(1)
+      if (end - start < 7) {
+        return false;
+      }
+
+      uint16_t impactMg = networkToUInt16(buffer, start+1);
+      uint8_t tiltDeg = buffer[start+3];
+      uint16_t freeFallMs = networkToUInt16(buffer, start+4);
+
+      xrp::imuConfigureMotionEvents(impactMg, tiltDeg, freeFallMs);
+      xrp::imuSetMotionCutoff(buffer[start+6]);
+    } break;
+    case XRP_TAG_PROXIMITY_STOP: {
+      // tag(1) distanceMm(2)
+      if (end - start < 3) {
+        return false;
+      }
+
+      xrp::setProximityStop(networkToUInt16(buffer, start+1));
+    } break;
+    case XRP_TAG_IMU_CONFIG: {
+      // tag(1) odrHz(2) accelRangeG(1) gyroRangeDps(2) filters(1)
+      if (end - start < 7) {
+        return false;
+      }
+
+      uint16_t odrHz = networkToUInt16(buffer, start+1);
+      uint8_t accelRangeG = buffer[start+3];
+      uint16_t gyroRangeDps = networkToUInt16(buffer, start+4);
+      uint8_t filters = buffer[start+6];
+
+      xrp::imuConfigureSensor(odrHz, accelRangeG, gyroRangeDps, filters);
+    } break;
+    case XRP_TAG_TELEMETRY_SYNC_CONFIG: {
+      // tag(1) leadUs(2)
+      if (end - start < 3) {
+        return false;
+      }
+
+      xrp::telemetrySyncSetLead(networkToUInt16(buffer, start+1));
+    } break;
+    case XRP_TAG_SYSID_START: {
+      // tag(1) motor(1) mode(1) value(4) durationMs(2)
+      if (end - start < 9) {
+        return false;
+      }
+
+      xrp::sysidStart(buffer[start+1], buffer[start+2], networkToFloat(buffer, start+3), networkToUInt16(buffer, start+7));
+    } break;
+    case XRP_TAG_SYSID_CONTROL: {
+      // tag(1) action(1) fromIndex(2)
+      if (end - start < 4) {
+        return false;
+      }
+
+      if (buffer[start+1] == XRP_SYSID_ACTION_ABORT) {
+        xrp::sysidAbort();
+      }
+      else if (buffer[start+1] == XRP_SYSID_ACTION_SEND) {
+        xrp::sysidRequestData(networkToUInt16(buffer, start+2));
+      }
+    } break;
     default:
       success = false;
   }
@@ -71,6 +264,23 @@ bool dsWatchdogActive() {
 
 void resetState() {
   currMaxSeq = 0;
+  _negotiatedProtocolVersion = 0;
+}
+
+bool capabilitiesRequested() {
+  return _capabilitiesRequested;
+}
+
+void clearCapabilitiesRequest() {
+  _capabilitiesRequested = false;
+}
+
+uint8_t negotiatedProtocolVersion() {
+  return _negotiatedProtocolVersion;
+}
+
+uint16_t telemetryOptions() {
+  return _telemetryOptions;
 }
 
 bool processPacket(char* buffer, int size) {
@@ -78,9 +288,6 @@ bool processPacket(char* buffer, int size) {
     return false;
   }
 
-  int startIdx = 0;
-  int endIdx = 0;
-
   // Overall packet format is
   //       2           1           n 
   // [    seq    ] [ ctrl ] [ tagged data ]
@@ -103,23 +310,36 @@ bool processPacket(char* buffer, int size) {
     }
   }
 
+  applyControl(ctrl);
+  processTags(buffer, 3, size);
+
+  return true;
+}
+
+void applyControl(uint8_t ctrl) {
   // Control byte essentially encodes the enabled/disabled state
   xrp::robotSetEnabled(ctrl == 1);
 
   // Feed the watchdog
   _dsWatchdog.feed();
+}
 
-  // Advance the start pointer
-  startIdx = 3;
+void processTags(char* buffer, int start, int end) {
+  int startIdx = start;
+  int endIdx = start;
 
   // We might have multiple tags in the same packet, so we basically need to take chunks of this
   // [ size ] [ tag ] [      data       ]
   // size does NOT include the size byte itself
 
-  while (startIdx < size) {
+  while (startIdx < end) {
     // Read the size
-    int msgSize = buffer[startIdx];
+    int msgSize = (uint8_t)buffer[startIdx];
     endIdx = startIdx + msgSize + 1;
+    if (endIdx > end || msgSize == 0) {
+      // Truncated or empty entry
+      break;
+    }
 
     // We pass in 1 past startIdx so that we only give the tag + payload
     bool result = _processTaggedData(buffer, startIdx+1, endIdx);
@@ -127,8 +347,6 @@ bool processPacket(char* buffer, int size) {
     // Advance the start pointer
     startIdx = endIdx;
   }
-
-  return true;
 }
 
 // ===================
@@ -198,4 +416,144 @@ int writeAnalogData(int deviceId, float voltage, char* buffer, int offset) {
   return 7; // +1 for size byte
 }
 
+int writeGyroCalStatusData(uint8_t state, uint8_t progress, char* buffer, int offset) {
+  // Gyro calibration status message is 3 bytes
+  // tag(1) state(1) progress(1)
+  buffer[offset] = 3;
+  buffer[offset+1] = XRP_TAG_GYRO_CAL_STATUS;
+  buffer[offset+2] = state;
+  buffer[offset+3] = progress;
+
+  return 4; // +1 for size byte
+}
+
+int writeCpuLoadData(uint8_t core0Pct, uint8_t core0LongPct, uint8_t core1Pct, uint8_t core1LongPct, char* buffer, int offset) {
+  // CPU load message is 5 bytes
+  // tag(1) core0(1) core0Long(1) core1(1) core1Long(1)
+  buffer[offset] = 5;
+  buffer[offset+1] = XRP_TAG_CPU_LOAD;
+  buffer[offset+2] = core0Pct;
+  buffer[offset+3] = core0LongPct;
+  buffer[offset+4] = core1Pct;
+  buffer[offset+5] = core1LongPct;
+
+  return 6; // +1 for size byte
+}
+
+int writeEventData(uint16_t eventId, uint8_t cause, uint8_t detail, uint32_t timeMs, char* buffer, int offset) {
+  // Event message is 9 bytes
+  // tag(1) id(2) cause(1) detail(1) timeMs(4)
+  buffer[offset] = 9;
+  buffer[offset+1] = XRP_TAG_EVENT;
+  uint16ToNetwork(eventId, buffer, offset+2);
+  buffer[offset+4] = cause;
+  buffer[offset+5] = detail;
+  uint32ToNetwork(timeMs, buffer, offset+6);
+
+  return 10; // +1 for size byte
+}
+
+int writeDistanceData(float distMetres, bool valid, uint8_t rateHz, char* buffer, int offset) {
+  // Distance message is 7 bytes
+  // tag(1) distance(4) valid(1) rateHz(1)
+  buffer[offset] = 7;
+  buffer[offset+1] = XRP_TAG_DISTANCE;
+  floatToNetwork(distMetres, buffer, offset+2);
+  buffer[offset+6] = valid ? 1 : 0;
+  buffer[offset+7] = rateHz;
+
+  return 8; // +1 for size byte
+}
+
+int writeSysIdStatusData(uint8_t state, uint16_t sampleCount, uint32_t samplePeriodUs, uint32_t overruns, char* buffer, int offset) {
+  // SysId status message is 12 bytes
+  // tag(1) state(1) sampleCount(2) samplePeriodUs(4) overruns(4)
+  buffer[offset] = 12;
+  buffer[offset+1] = XRP_TAG_SYSID_STATUS;
+  buffer[offset+2] = state;
+  uint16ToNetwork(sampleCount, buffer, offset+3);
+  uint32ToNetwork(samplePeriodUs, buffer, offset+5);
+  uint32ToNetwork(overruns, buffer, offset+9);
+
+  return 13; // +1 for size byte
+}
+
+int writeSysIdData(uint16_t firstIndex, const xrp::SysIdSample* samples, int count, char* buffer, int offset) {
+  // SysId data message is 4 + 14n bytes
+  // tag(1) firstIndex(2) count(1) [timeUs(4) output(2) position(4) velocity(4)] per sample
+  buffer[offset] = 4 + (14 * count);
+  buffer[offset+1] = XRP_TAG_SYSID_DATA;
+  uint16ToNetwork(firstIndex, buffer, offset+2);
+  buffer[offset+4] = count;
+
+  int ptr = offset + 5;
+  for (int i = 0; i < count; i++) {
+    uint32ToNetwork(samples[i].timeUs, buffer, ptr);
+    int16ToNetwork((int16_t)lroundf(samples[i].output * XRP_ACTUATOR_STATE_SCALE), buffer, ptr+4);
+    int32ToNetwork(samples[i].position, buffer, ptr+6);
+    floatToNetwork(samples[i].velocity, buffer, ptr+10);
+    ptr += 14;
+  }
+
+  return ptr - offset;
+}
+
+int writeActuatorStateData(const float outputs[], const uint8_t reasons[], int numChannels, char* buffer, int offset) {
+  // Actuator state message is 1 + 3n bytes
+  // tag(1) [output(2) reason(1)] per channel
+  buffer[offset] = 1 + (3 * numChannels);
+  buffer[offset+1] = XRP_TAG_ACTUATOR_STATE;
+
+  int ptr = offset + 2;
+  for (int ch = 0; ch < numChannels; ch++) {
+    int16ToNetwork((int16_t)lroundf(outputs[ch] * XRP_ACTUATOR_STATE_SCALE), buffer, ptr);
+    buffer[ptr+2] = reasons[ch];
+    ptr += 3;
+  }
+
+  return ptr - offset;
+}
+
+int writeTelemetrySyncData(bool locked, uint32_t periodUs, int32_t phaseErrorUs, char* buffer, int offset) {
+  // Telemetry sync message is 10 bytes
+  // tag(1) locked(1) periodUs(4) phaseErrorUs(4)
+  buffer[offset] = 10;
+  buffer[offset+1] = XRP_TAG_TELEMETRY_SYNC;
+  buffer[offset+2] = locked ? 1 : 0;
+  uint32ToNetwork(periodUs, buffer, offset+3);
+  int32ToNetwork(phaseErrorUs, buffer, offset+7);
+
+  return 11; // +1 for size byte
+}
+
+int writeImuStatusData(uint8_t flags, float temperatureC, char* buffer, int offset) {
+  // IMU status message is 6 bytes
+  // tag(1) flags(1) temperature(4)
+  buffer[offset] = 6;
+  buffer[offset+1] = XRP_TAG_IMU_STATUS;
+  buffer[offset+2] = flags;
+  floatToNetwork(temperatureC, buffer, offset+3);
+
+  return 7; // +1 for size byte
+}
+
+int writeCapabilitiesData(uint8_t fwVersion[3], uint8_t maxRateHz, uint8_t sensors, char* buffer, int offset) {
+  // Capabilities message is 9 + n bytes
+  // tag(1) fwMajor(1) fwMinor(1) fwPatch(1) protoVersion(1) maxRateHz(1) encodings(1) sensors(1) numTags(1) tags(n)
+  int numTags = sizeof(_supportedTags);
+  buffer[offset] = 9 + numTags;
+  buffer[offset+1] = XRP_TAG_CAPABILITIES;
+  buffer[offset+2] = fwVersion[0];
+  buffer[offset+3] = fwVersion[1];
+  buffer[offset+4] = fwVersion[2];
+  buffer[offset+5] = _negotiatedProtocolVersion;
+  buffer[offset+6] = maxRateHz;
+  buffer[offset+7] = XRP_CAP_ENCODING_FLOAT32;
+  buffer[offset+8] = sensors;
+  buffer[offset+9] = numTags;
+  memcpy(buffer + offset + 10, _supportedTags, numTags);
+
+  return 10 + numTags; // +1 for size byte
+}
+
 } // namespace wpilibudp
\ No newline at end of file